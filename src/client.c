@@ -30,6 +30,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <stdio.h>
@@ -39,72 +40,2124 @@
 #include <errno.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <endian.h>
 #include <hislip/client.h>
 #include <hislip/common.h>
 #include "tcp.h"
 #include "session.h"
+#include "ring.h"
 #include "error.h"
 #include "message.h"
 
-hs_client_t hs_connect(char *address, int port, char *subaddress, int timeout)
+#define CLIENT_MAX_MESSAGE_SIZE 0x1000000 // 16 MB
+#define CLIENT_RECEIVE_BUFFER_SIZE 0x4000 // 16 KB
+#define CLIENT_LOOP_EVENTS_MAX 16
+#define CLIENT_LOOP_SRQ (1ULL << 31) // Event of asynchronous channel
+#define CLIENT_SRQ_TIMEOUT 1000 // 1 second
+#define CLIENT_ASYNC_DEPTH 64
+
+// Client request waiting for its response
+typedef struct
 {
-    int sd, i;
-    void *message = NULL;
-    uint16_t version = (HISLIP_VERSION_MAJOR << 8) + HISLIP_VERSION_MINOR;
-    uint32_t parameter = (version << 16) + HISLIP_VENDOR_ID;
-    ssize_t length;
+    hs_receive_callback_t callback;
+    void *data;
+    uint32_t message_id;
+} client_pending_t;
+
+// Client asynchronous operation state, serviced by client event loop
+typedef struct
+{
+    pthread_mutex_t mutex;
+    pthread_mutex_t send_mutex;
+    pthread_cond_t idle;
+    pthread_t thread;
+    bool attached;
+    bool busy;
+    uint32_t generation;
+
+    // Requests in flight, oldest first
+    client_pending_t *pending;
+    int pending_head;
+    int pending_count;
+
+    // Response being received
+    msg_header_t msg_header;
+    bool header_valid;
+    bool discard;
+    uint64_t received;
+    char *response;
+    uint64_t response_length;
+    uint64_t response_size;
+
+    // Service requests arriving on asynchronous channel. Transactions on the
+    // channel hold channel_mutex, event loop only reads while it is idle.
+    pthread_mutex_t channel_mutex;
+    hs_srq_callback_t srq_callback;
+    void *srq_data;
+    bool srq_attached;
+    bool srq_busy;
+    bool srq_deferred;
+    pthread_t srq_thread;
+
+    // Lock request waiting with channel released. Whoever reads the
+    // response hands it over, responses of requests given up are dropped.
+    pthread_mutex_t lock_mutex;
+    pthread_cond_t lock_cond;
+    bool lock_waiting;
+    bool lock_watch; // Event loop watches channel for lock request only
+    int lock_response;
+    int lock_stale;
+} client_async_t;
+
+// Client only state of session, kept at the index of its session table entry
+typedef struct
+{
+    // Sync channel receive buffer
+    ring_t receive;
+
+    // MessageID of most recent Data/DataEnd sent
+    uint32_t message_id_sent;
+
+    // Complete response delivered since last message sent (RMT)
+    bool rmt_delivered;
+
+    client_async_t async;
+} client_session_t;
+
+static client_session_t *client_session;
+
+static pthread_once_t client_once = PTHREAD_ONCE_INIT;
+
+// Event loop shared by all asynchronous sessions
+static struct
+{
+    pthread_mutex_t mutex;
+    int epoll;
+} client_loop = { PTHREAD_MUTEX_INITIALIZER, -1 };
+
+static int client_async_detach(hs_client_t client);
+static void client_srq_detach(hs_client_t client);
+
+typedef enum
+{
+    CONNECT_RESOLVE,
+    CONNECT_SYNC,
+    CONNECT_INITIALIZE,
+    CONNECT_ASYNC,
+    CONNECT_ASYNC_INITIALIZE,
+    CONNECT_MAXIMUM_MESSAGE_SIZE,
+    CONNECT_DONE,
+    CONNECT_FAILED
+} client_connect_state_t;
+
+// Connection being established by hs_connect_many()
+typedef struct
+{
+    hs_connect_target_t *target;
+    client_connect_state_t state;
+    tcp_resolve_t *resolve;
+    tcp_address_t address;
+    int session;
+    int sd;
+    short events;
+    int poll;
+    msg_header_t msg_header;
+    uint8_t buffer[MSG_HEADER_SIZE + 256];
+    uint64_t received;
+} client_connect_t;
+
+// Group request shared with callbacks, which may outlive the call on timeout
+typedef struct client_group client_group_t;
+
+typedef struct
+{
+    client_group_t *group;
+    int index;
+    bool detach;
+} client_group_entry_t;
+
+struct client_group
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+    hs_group_member_t *members;
+    int outstanding;
+    int refs;
+    bool expired;
+    client_group_entry_t entry[];
+};
+
+/*
+ * client_read() - Read exact number of bytes
+ *
+ * Reads through receive buffer if one is given so that a header and a short
+ * payload arriving together cost a single read. Large payloads bypass the
+ * buffer once it is drained.
+ *
+ */
+
+static int client_read(int sd, ring_t *ring, void *buffer, uint64_t length, int timeout)
+{
+    char *bufferp = buffer;
+    uint64_t bytes_received = 0;
+    size_t available;
+    void *pointer;
+    int status;
 
-    // Create new session
-    i = session_new();
-    if (i < 0)
+    // Read until all bytes are received
+    while (bytes_received < length)
     {
-        error_printf("Could not allocate new session!\n");
-        goto error_session;
+        if ((ring != NULL) && (ring_used(ring) > 0))
+        {
+            bytes_received += ring_read(ring, bufferp + bytes_received, length - bytes_received);
+            continue;
+        }
+
+        if ((ring == NULL) || (length - bytes_received >= ring->size))
+        {
+            status = tcp_read(sd, bufferp + bytes_received, length - bytes_received, timeout);
+            if (status <= 0)
+                return -1;
+            bytes_received += status;
+            continue;
+        }
+
+        // Fill receive buffer with whatever is available
+        pointer = ring_write_pointer(ring, &available);
+        status = tcp_read(sd, pointer, available, timeout);
+        if (status <= 0)
+            return -1;
+        ring_write_commit(ring, status);
     }
 
-    // Create TCP connection
-    if (tcp_connect(&sd, address, port, timeout) != 0)
-        goto error_connect;
+    return 0;
+}
+
+static int client_send(int sd, msg_type_t type, uint8_t control_code, uint32_t parameter,
+        void *payload, uint64_t payload_length, int timeout)
+{
+    void *message;
+    int status;
 
-    // Save sync channel socket
-    session[i].socket_sync = sd;
+    // Control messages are small, send header and payload in one buffer
+    if (msg_create(&message, type, control_code, parameter, payload_length, payload) != 0)
+        return -1;
 
-    // Create Initialize message
-    length = msg_create(message, Initialize, 0, parameter, strlen(subaddress), subaddress);
+    status = tcp_write(sd, message, MSG_HEADER_SIZE + payload_length, timeout);
+    msg_destroy(message);
 
-    // send Initialize message
-    tcp_write(sd, message, length, timeout);
+    return (status < 0) ? -1 : 0;
+}
 
-    // Wait for InitializeResponse message
+static int client_skip(int sd, ring_t *ring, uint64_t length, int timeout)
+{
+    char buffer[4096];
+    uint64_t chunk;
 
-    // session[i].SessionID = ...
+    // Drop what is already buffered first
+    if (ring != NULL)
+        length -= ring_skip(ring, length);
 
-    // Return client session handle
-    return i;
+    // Read and throw away payload not wanted
+    while (length > 0)
+    {
+        chunk = (length > sizeof(buffer)) ? sizeof(buffer) : length;
+        if (client_read(sd, NULL, buffer, chunk, timeout) != 0)
+            return -1;
+        length -= chunk;
+    }
 
-error_connect:
-    session_free(i);
-error_session:
-    return -1;
+    return 0;
 }
 
-int hs_disconnect(hs_client_t client)
+/*
+ * client_lock_deliver() - Hand over lock response
+ *
+ * Lock responses are read by whoever reads the async channel while a lock
+ * request waits, and passed to it here.
+ *
+ */
+
+static void client_lock_deliver(hs_client_t client, uint8_t control_code)
 {
-    tcp_disconnect(session[client].socket_sync);
+    client_async_t *a = &client_session[client].async;
 
-    session_free(client);
+    pthread_mutex_lock(&a->mutex);
+
+    if (a->lock_stale > 0)
+        a->lock_stale--;
+    else if (a->lock_waiting)
+    {
+        a->lock_response = control_code;
+        pthread_cond_broadcast(&a->lock_cond);
+    }
+    else
+        error_printf("Unexpected lock response\n");
+
+    pthread_mutex_unlock(&a->mutex);
+}
+
+static int client_receive(hs_client_t client, msg_type_t type, msg_header_t *msg_header,
+        void *payload, uint64_t capacity, int *srq, int timeout)
+{
+    int sd = session[client].socket_async;
+    uint8_t header[MSG_HEADER_SIZE];
+
+    // Receive message header, service requests and the response of a lock
+    // request waiting may arrive ahead of response
+    while (true)
+    {
+        if (client_read(sd, NULL, header, MSG_HEADER_SIZE, timeout) != 0)
+            return -1;
+
+        msg_header_decode(msg_header, header);
+        if (msg_header_verify(msg_header))
+            return -1;
+
+        if ((msg_header->type != AsyncServiceRequest) && (msg_header->type != AsyncLockResponse))
+            break;
+
+        if (client_skip(sd, NULL, msg_header->payload_length, timeout) != 0)
+            return -1;
+
+        if (msg_header->type == AsyncLockResponse)
+            client_lock_deliver(client, msg_header->control_code);
+        else
+            *srq = msg_header->control_code;
+    }
+
+    if (msg_header->payload_length > capacity)
+    {
+        error_printf("Received message too large\n");
+        return -1;
+    }
+
+    // Receive payload
+    if (client_read(sd, NULL, payload, msg_header->payload_length, timeout) != 0)
+        return -1;
+
+    if (msg_header->type != type)
+    {
+        error_printf("Unexpected message type %d received\n", msg_header->type);
+        return -1;
+    }
 
     return 0;
 }
 
+/*
+ * client_srq_deliver() - Deliver service request
+ *
+ * Runs service request callback, if any, with no session lock held. Status
+ * is the status byte received or -1 if no service request arrived.
+ *
+ */
+
+static void client_srq_deliver(hs_client_t client, int status)
+{
+    client_async_t *a = &client_session[client].async;
+    hs_srq_callback_t callback;
+    void *data;
+
+    if (status < 0)
+        return;
+
+    pthread_mutex_lock(&a->mutex);
+    callback = a->srq_callback;
+    data = a->srq_data;
+    pthread_mutex_unlock(&a->mutex);
+
+    if (callback != NULL)
+        callback(client, status, data);
+}
+
+/*
+ * client_srq_resume() - Resume watching async channel
+ *
+ * Event loop leaves async channel alone while a transaction holds it,
+ * which may take long for a lock request, and is rearmed here instead.
+ *
+ */
+
+static void client_srq_resume(hs_client_t client)
+{
+    client_async_t *a = &client_session[client].async;
+    struct epoll_event event;
+
+    pthread_mutex_lock(&a->mutex);
+
+    if (a->srq_attached && a->srq_deferred)
+    {
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.u64 = CLIENT_LOOP_SRQ | client;
+        epoll_ctl(client_loop.epoll, EPOLL_CTL_MOD, session[client].socket_async, &event);
+    }
+    a->srq_deferred = false;
+
+    pthread_mutex_unlock(&a->mutex);
+}
+
+/*
+ * client_transact() - Request and response on async channel
+ *
+ * Sends request and waits for response of given type. The channel is held
+ * meanwhile so the event loop does not read the response, service requests
+ * arriving ahead of it are delivered once the channel is released.
+ *
+ */
+
+static int client_transact(hs_client_t client, msg_type_t type, uint8_t control_code, uint32_t parameter,
+        void *payload, uint64_t payload_length, msg_type_t response_type, msg_header_t *msg_header,
+        void *response, uint64_t capacity, int timeout)
+{
+    session_t *s = &session[client];
+    int srq = -1, status;
+
+    pthread_mutex_lock(&client_session[client].async.channel_mutex);
+
+    status = client_send(s->socket_async, type, control_code, parameter, payload, payload_length, timeout);
+    if (status == 0)
+        status = client_receive(client, response_type, msg_header, response, capacity, &srq, timeout);
+
+    pthread_mutex_unlock(&client_session[client].async.channel_mutex);
+
+    client_srq_resume(client);
+    client_srq_deliver(client, srq);
+
+    return status;
+}
+
+/*
+ * client_lock_transact() - AsyncLock request and response
+ *
+ * A lock request may wait long for the lock, so unlike client_transact()
+ * the async channel is released once the request is sent, and status
+ * queries and device clear go ahead meanwhile. The event loop watches the
+ * channel until the response is read, by it or by another transaction.
+ * Returns response control code, or -1 on error.
+ *
+ */
+
+static int client_lock_transact(hs_client_t client, uint8_t control_code, uint32_t parameter,
+        void *payload, uint64_t payload_length, int timeout)
+{
+    session_t *s = &session[client];
+    client_async_t *a = &client_session[client].async;
+    struct epoll_event event;
+    struct timespec deadline;
+    int status = 0, response = -1;
+    bool sent = false;
+
+    if (hs_client_loop_init(1) != 0)
+        return -1;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    // One lock request per session at a time
+    pthread_mutex_lock(&a->lock_mutex);
+    pthread_mutex_lock(&a->channel_mutex);
+    pthread_mutex_lock(&a->mutex);
+
+    a->lock_waiting = true;
+    a->lock_response = -1;
+
+    if (!a->srq_attached)
+    {
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.u64 = CLIENT_LOOP_SRQ | client;
+        if (epoll_ctl(client_loop.epoll, EPOLL_CTL_ADD, s->socket_async, &event) != 0)
+        {
+            error_printf("epoll_ctl() failed\n");
+            status = -1;
+        }
+        else
+        {
+            a->srq_attached = true;
+            a->lock_watch = true;
+        }
+    }
+
+    pthread_mutex_unlock(&a->mutex);
+
+    if (status == 0)
+    {
+        status = client_send(s->socket_async, AsyncLock, control_code, parameter, payload, payload_length, timeout);
+        sent = (status == 0);
+    }
+
+    pthread_mutex_unlock(&a->channel_mutex);
+    client_srq_resume(client);
+
+    pthread_mutex_lock(&a->mutex);
+
+    // Channel failing stops event loop watching it
+    while ((status == 0) && (a->lock_response < 0) && a->srq_attached)
+    {
+        if (timeout == 0)
+            pthread_cond_wait(&a->lock_cond, &a->mutex);
+        else if (pthread_cond_timedwait(&a->lock_cond, &a->mutex, &deadline) == ETIMEDOUT)
+        {
+            errno = ETIMEDOUT;
+            status = -1;
+        }
+    }
+
+    if (a->lock_response >= 0)
+        response = a->lock_response;
+    else if (sent && a->srq_attached)
+        a->lock_stale++;
+    else if (status == 0)
+        errno = ECONNRESET;
+
+    a->lock_waiting = false;
+
+    // Stop watching channel unless service requests are wanted
+    if (a->lock_watch)
+    {
+        while (a->srq_busy && !pthread_equal(a->srq_thread, pthread_self()))
+            pthread_cond_wait(&a->idle, &a->mutex);
+
+        if (a->srq_attached)
+            epoll_ctl(client_loop.epoll, EPOLL_CTL_DEL, s->socket_async, NULL);
+        a->srq_attached = false;
+        a->lock_watch = false;
+    }
+
+    pthread_mutex_unlock(&a->mutex);
+    pthread_mutex_unlock(&a->lock_mutex);
+
+    return response;
+}
+
+static uint64_t client_fragment_size_max(session_t *s)
+{
+    return (s->max_message_size_send > MSG_HEADER_SIZE) ? s->max_message_size_send - MSG_HEADER_SIZE : 1;
+}
+
+static void client_init(void)
+{
+    int i;
+
+    if (session_init(MAX_SESSIONS) != 0)
+        return;
+
+    client_session = calloc(session_capacity, sizeof(client_session_t));
+    if (client_session == NULL)
+    {
+        error_printf("calloc() failed\n");
+        return;
+    }
+
+    // Session locks outlive sessions so event loop can always take them
+    for (i=0; i<session_capacity; i++)
+    {
+        pthread_mutex_init(&client_session[i].async.mutex, NULL);
+        pthread_mutex_init(&client_session[i].async.send_mutex, NULL);
+        pthread_mutex_init(&client_session[i].async.channel_mutex, NULL);
+        pthread_mutex_init(&client_session[i].async.lock_mutex, NULL);
+        pthread_cond_init(&client_session[i].async.idle, NULL);
+        pthread_cond_init(&client_session[i].async.lock_cond, NULL);
+    }
+}
+
+/*
+ * client_connect_*() - Connection establishment state machine
+ *
+ * Each target walks through connecting both channels and the Initialize,
+ * AsyncInitialize and AsyncMaximumMessageSize exchanges. Sockets are only
+ * ever read when polled readable, so any number of targets progress
+ * concurrently in a single thread.
+ *
+ */
 
-int hs_send_receive_sync(hs_client_t client, void *message, int *length, int timeout)
+static int client_connect_setup(client_connect_t *c)
 {
+    tcp_resolve_t *resolve = c->resolve;
+
+    c->resolve = NULL;
+    if (tcp_resolve_finish(resolve, &c->address) != 0)
+        return -1;
+
+    if (client_session == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    c->session = session_new();
+    if (c->session < 0)
+    {
+        error_printf("Could not allocate new session!\n");
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (ring_init(&client_session[c->session].receive, CLIENT_RECEIVE_BUFFER_SIZE) != 0)
+    {
+        session_free(c->session);
+        c->session = -1;
+        errno = ENOMEM;
+        return -1;
+    }
+    client_session[c->session].message_id_sent = MSG_ID_INITIAL - 2;
+    client_session[c->session].rmt_delivered = false;
+    client_session[c->session].async.lock_stale = 0;
+
+    if (tcp_connect_start(&session[c->session].socket_sync, &c->address) != 0)
+        return -1;
+
+    c->sd = session[c->session].socket_sync;
+    c->events = POLLOUT;
+    c->state = CONNECT_SYNC;
+
     return 0;
 }
 
-int hs_send_receive_async(hs_client_t client, void *message, int length, int timeout,
-        void (*receive_callback)(void *message, int length))
+static void client_connect_cleanup(client_connect_t *c)
+{
+    session_t *s;
+
+    if (c->resolve != NULL)
+    {
+        tcp_resolve_finish(c->resolve, &c->address);
+        c->resolve = NULL;
+    }
+
+    if (c->session < 0)
+        return;
+
+    s = &session[c->session];
+    if (s->socket_async >= 0)
+        tcp_disconnect(s->socket_async);
+    if (s->socket_sync >= 0)
+        tcp_disconnect(s->socket_sync);
+    ring_destroy(&client_session[c->session].receive);
+    session_free(c->session);
+    c->session = -1;
+}
+
+static int client_connect_receive(client_connect_t *c, msg_type_t type)
+{
+    uint64_t length;
+    int status;
+
+    // Header first, then payload
+    length = MSG_HEADER_SIZE;
+    if (c->received >= MSG_HEADER_SIZE)
+        length += c->msg_header.payload_length;
+
+    status = tcp_read(c->sd, c->buffer + c->received, length - c->received, -1);
+    if (status <= 0)
+    {
+        if ((status < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+            return 0;
+        errno = (status == 0) ? ECONNRESET : errno;
+        return -1;
+    }
+    c->received += status;
+
+    if (c->received == MSG_HEADER_SIZE)
+    {
+        msg_header_decode(&c->msg_header, c->buffer);
+        if (msg_header_verify(&c->msg_header))
+        {
+            errno = EPROTO;
+            return -1;
+        }
+        if (c->msg_header.payload_length > sizeof(c->buffer) - MSG_HEADER_SIZE)
+        {
+            error_printf("Received message too large\n");
+            errno = EPROTO;
+            return -1;
+        }
+    }
+
+    if ((c->received < MSG_HEADER_SIZE) ||
+        (c->received < MSG_HEADER_SIZE + c->msg_header.payload_length))
+        return 0;
+
+    c->received = 0;
+
+    if (c->msg_header.type != type)
+    {
+        error_printf("Unexpected message type %d received\n", c->msg_header.type);
+        errno = (c->msg_header.type == FatalError) ? ECONNREFUSED : EPROTO;
+        return -1;
+    }
+
+    return 1;
+}
+
+static int client_connect_step(client_connect_t *c, int timeout)
 {
+    hs_connect_target_t *target = c->target;
+    uint16_t version = (HISLIP_VERSION_MAJOR << 8) + HISLIP_VERSION_MINOR;
+    uint64_t value;
+    session_t *s;
+    int status;
+
+    // Name lookup done, start connecting
+    if (c->state == CONNECT_RESOLVE)
+        return client_connect_setup(c);
+
+    s = &session[c->session];
+
+    switch (c->state)
+    {
+        case CONNECT_SYNC:
+            if (tcp_connect_finish(c->sd) != 0)
+                return -1;
+
+            if (client_send(c->sd, Initialize, 0, (version << 16) + HISLIP_VENDOR_ID,
+                        target->subaddress, strlen(target->subaddress), timeout) != 0)
+                return -1;
+
+            c->events = POLLIN;
+            c->state = CONNECT_INITIALIZE;
+            break;
+
+        case CONNECT_INITIALIZE:
+            status = client_connect_receive(c, InitializeResponse);
+            if (status <= 0)
+                return status;
+
+            s->SessionID = c->msg_header.parameter & 0xFFFF;
+            s->overlap = (c->msg_header.control_code == CC_PREFER_OVERLAP);
+
+            // Open async channel
+            if (tcp_connect_start(&s->socket_async, &c->address) != 0)
+                return -1;
+
+            c->sd = s->socket_async;
+            c->events = POLLOUT;
+            c->state = CONNECT_ASYNC;
+            break;
+
+        case CONNECT_ASYNC:
+            if (tcp_connect_finish(c->sd) != 0)
+                return -1;
+
+            if (client_send(c->sd, AsyncInitialize, 0, s->SessionID, NULL, 0, timeout) != 0)
+                return -1;
+
+            c->events = POLLIN;
+            c->state = CONNECT_ASYNC_INITIALIZE;
+            break;
+
+        case CONNECT_ASYNC_INITIALIZE:
+            status = client_connect_receive(c, AsyncInitializeResponse);
+            if (status <= 0)
+                return status;
+
+            // Negotiate maximum message sizes
+            value = htobe64(CLIENT_MAX_MESSAGE_SIZE);
+            if (client_send(c->sd, AsyncMaximumMessageSize, 0, 0, &value, sizeof(value), timeout) != 0)
+                return -1;
+
+            c->state = CONNECT_MAXIMUM_MESSAGE_SIZE;
+            break;
+
+        case CONNECT_MAXIMUM_MESSAGE_SIZE:
+            status = client_connect_receive(c, AsyncMaximumMessageSizeResponse);
+            if (status <= 0)
+                return status;
+
+            if (c->msg_header.payload_length != sizeof(value))
+            {
+                errno = EPROTO;
+                return -1;
+            }
+
+            memcpy(&value, c->buffer + MSG_HEADER_SIZE, sizeof(value));
+            s->max_message_size_receive = CLIENT_MAX_MESSAGE_SIZE;
+            s->max_message_size_send = be64toh(value);
+
+            c->state = CONNECT_DONE;
+            break;
+
+        default:
+            break;
+    }
+
     return 0;
 }
+
+/*
+ * hs_connect_many() - Connect to several servers concurrently
+ *
+ * Establishes sessions with all targets at once using concurrent name
+ * lookups, non-blocking connects and interleaved handshakes, so a dead or
+ * unresolvable host only costs the timeout (ms, 0 waits forever) and not a
+ * serial connect. Per target result is stored in
+ * client and error. Returns 0 if all targets connected, otherwise -1.
+ *
+ */
+
+int hs_connect_many(hs_connect_target_t *targets, int count, int timeout)
+{
+    client_connect_t *connect;
+    struct pollfd *pfd;
+    struct timespec start, now;
+    int i, n, pending = 0, wait, status = 0;
+
+    pthread_once(&client_once, client_init);
+
+    connect = calloc(count, sizeof(client_connect_t));
+    pfd = calloc(count, sizeof(struct pollfd));
+    if ((connect == NULL) || (pfd == NULL))
+    {
+        error_printf("calloc() failed\n");
+        free(connect);
+        free(pfd);
+        return -1;
+    }
+
+    // Name lookups of all targets overlap and count against timeout
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (i=0; i<count; i++)
+    {
+        connect[i].target = &targets[i];
+        connect[i].session = -1;
+        targets[i].client = -1;
+        targets[i].error = 0;
+
+        connect[i].resolve = tcp_resolve_start(targets[i].address, targets[i].port);
+        if (connect[i].resolve == NULL)
+        {
+            targets[i].error = errno;
+            connect[i].state = CONNECT_FAILED;
+            continue;
+        }
+        connect[i].sd = tcp_resolve_fd(connect[i].resolve);
+        connect[i].events = POLLIN;
+        connect[i].state = CONNECT_RESOLVE;
+        pending++;
+    }
+
+    while (pending > 0)
+    {
+        // Poll all targets in progress
+        for (i=0, n=0; i<count; i++)
+        {
+            if ((connect[i].state == CONNECT_DONE) || (connect[i].state == CONNECT_FAILED))
+                continue;
+            pfd[n].fd = connect[i].sd;
+            pfd[n].events = connect[i].events;
+            pfd[n].revents = 0;
+            connect[i].poll = n++;
+        }
+
+        wait = -1;
+        if (timeout > 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            wait = timeout - ((now.tv_sec - start.tv_sec) * 1000 +
+                    (now.tv_nsec - start.tv_nsec) / 1000000);
+            if (wait <= 0)
+                break;
+        }
+
+        if (poll(pfd, n, wait) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            error_printf("poll() failed\n");
+            break;
+        }
+
+        for (i=0; i<count; i++)
+        {
+            client_connect_t *c = &connect[i];
+
+            if ((c->state == CONNECT_DONE) || (c->state == CONNECT_FAILED) ||
+                (pfd[c->poll].revents == 0))
+                continue;
+
+            if (client_connect_step(c, timeout) != 0)
+            {
+                targets[i].error = errno;
+                client_connect_cleanup(c);
+                c->state = CONNECT_FAILED;
+                pending--;
+            }
+            else if (c->state == CONNECT_DONE)
+            {
+                targets[i].client = c->session;
+                pending--;
+            }
+        }
+    }
+
+    // Targets still in progress have run out of time
+    for (i=0; i<count; i++)
+    {
+        if ((connect[i].state != CONNECT_DONE) && (connect[i].state != CONNECT_FAILED))
+        {
+            error_printf("Connecting to %s timed out\n", targets[i].address);
+            targets[i].error = ETIMEDOUT;
+            client_connect_cleanup(&connect[i]);
+        }
+
+        if (targets[i].client < 0)
+            status = -1;
+    }
+
+    free(pfd);
+    free(connect);
+
+    return status;
+}
+
+hs_client_t hs_connect(char *address, int port, char *subaddress, int timeout)
+{
+    hs_connect_target_t target;
+
+    target.address = address;
+    target.port = port;
+    target.subaddress = subaddress;
+
+    hs_connect_many(&target, 1, timeout);
+
+    return target.client;
+}
+
+int hs_disconnect(hs_client_t client)
+{
+    client_async_detach(client);
+    client_srq_detach(client);
+
+    tcp_disconnect(session[client].socket_async);
+    tcp_disconnect(session[client].socket_sync);
+    ring_destroy(&client_session[client].receive);
+
+    session_free(client);
+
+    return 0;
+}
+
+/*
+ * hs_set_max_message_size() - Negotiate maximum message size
+ *
+ * Tells server the largest message (including header) client accepts on the
+ * sync channel and learns the largest message server accepts, which is then
+ * used for sending. Done as part of hs_connect() with a default size.
+ *
+ */
+
+int hs_set_max_message_size(hs_client_t client, uint64_t size, int timeout)
+{
+    msg_header_t msg_header;
+    uint64_t value = htobe64(size);
+
+    if ((client_transact(client, AsyncMaximumMessageSize, 0, 0, &value, sizeof(value),
+                    AsyncMaximumMessageSizeResponse, &msg_header, &value, sizeof(value), timeout) != 0) ||
+        (msg_header.payload_length != sizeof(value)))
+    {
+        error_printf("AsyncMaximumMessageSize failed\n");
+        return -1;
+    }
+
+    session[client].max_message_size_receive = size;
+    session[client].max_message_size_send = be64toh(value);
+
+    return 0;
+}
+
+uint64_t hs_get_max_message_size(hs_client_t client)
+{
+    return session[client].max_message_size_send;
+}
+
+/*
+ * hs_device_clear() - Clear device
+ *
+ * Performs the device clear transaction: the server abandons queued and
+ * running requests, both sides drop messages still underway and MessageIDs
+ * start over. Requests pending with hs_send_receive_async() fail. The mode
+ * preferred by the server is negotiated.
+ *
+ */
+
+int hs_device_clear(hs_client_t client, int timeout)
+{
+    session_t *s = &session[client];
+    client_session_t *cs = &client_session[client];
+    client_async_t *a = &cs->async;
+    uint8_t header[MSG_HEADER_SIZE];
+    msg_header_t msg_header;
+    uint64_t partial = 0;
+    uint8_t features;
+
+    // Abandon pending asynchronous requests, event loop stops reading
+    client_async_detach(client);
+
+    // Event loop may have stopped in the middle of a message
+    if (a->header_valid)
+    {
+        partial = a->msg_header.payload_length - a->received;
+        a->header_valid = false;
+    }
+
+    if (client_transact(client, AsyncDeviceClear, 0, 0, NULL, 0,
+                AsyncDeviceClearAcknowledge, &msg_header, NULL, 0, timeout) != 0)
+    {
+        error_printf("AsyncDeviceClear failed\n");
+        return -1;
+    }
+
+    // Request features server prefers
+    features = msg_header.control_code;
+    if (client_send(s->socket_sync, DeviceClearComplete, features, 0, NULL, 0, timeout) != 0)
+        return -1;
+
+    // Drop rest of partly received message and responses underway until
+    // server acknowledges
+    if (client_skip(s->socket_sync, &cs->receive, partial, timeout) != 0)
+        return -1;
+
+    do
+    {
+        if (client_read(s->socket_sync, &cs->receive, header, MSG_HEADER_SIZE, timeout) != 0)
+            return -1;
+
+        msg_header_decode(&msg_header, header);
+        if (msg_header_verify(&msg_header))
+            return -1;
+
+        if (client_skip(s->socket_sync, &cs->receive, msg_header.payload_length, timeout) != 0)
+            return -1;
+    }
+    while (msg_header.type != DeviceClearAcknowledge);
+
+    s->overlap = (msg_header.control_code & CC_PREFER_OVERLAP) != 0;
+    s->message_id = MSG_ID_INITIAL;
+    cs->message_id_sent = MSG_ID_INITIAL - 2;
+    s->message_id_received = MSG_ID_INITIAL - 2;
+    __atomic_store_n(&cs->rmt_delivered, false, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/*
+ * hs_status_query() - Read status byte
+ *
+ * Reads the 8-bit status of the server (as viReadSTB) on the async channel,
+ * so it is answered right away even while the sync channel is busy moving
+ * data.
+ *
+ */
+
+int hs_status_query(hs_client_t client, uint8_t *status, int timeout)
+{
+    session_t *s = &session[client];
+    client_session_t *cs = &client_session[client];
+    msg_header_t msg_header;
+    uint32_t message_id;
+    uint8_t control_code;
+
+    // Query reports RMT-delivered like Data/DataEnd do
+    control_code = __atomic_exchange_n(&cs->rmt_delivered, false, __ATOMIC_RELAXED) ?
+        CC_RMT_DELIVERED : 0;
+
+    // MessageID of most recently sent message in synchronized mode, of most
+    // recently delivered response in overlapped mode (0xfffffefe if none)
+    message_id = s->overlap ? s->message_id_received : s->message_id - 2;
+    if (client_transact(client, AsyncStatusQuery, control_code, message_id, NULL, 0,
+                AsyncStatusResponse, &msg_header, NULL, 0, timeout) != 0)
+    {
+        error_printf("AsyncStatusQuery failed\n");
+        return -1;
+    }
+
+    *status = msg_header.control_code;
+
+    return 0;
+}
+
+/*
+ * hs_lock() - Request lock
+ *
+ * Requests shared lock identified by key, or exclusive lock if key is NULL
+ * or empty, waiting up to lock_timeout ms for the lock to be granted. Other
+ * requests for the lock are granted first come first served. Fails with
+ * errno EBUSY if the lock was not granted in time, and EINVAL if the lock
+ * requested is held already.
+ *
+ */
+
+int hs_lock(hs_client_t client, char *key, int lock_timeout, int timeout)
+{
+    uint64_t length = (key != NULL) ? strlen(key) : 0;
+    int response;
+
+    // Response may only come once lock is available
+    response = client_lock_transact(client, CC_REQUEST, lock_timeout, key, length,
+            timeout ? lock_timeout + timeout : 0);
+    if (response < 0)
+    {
+        error_printf("AsyncLock failed\n");
+        return -1;
+    }
+
+    switch (response)
+    {
+        case CC_REQUEST_RSP_SUCCESS:
+            return 0;
+        case CC_REQUEST_RSP_FAIL:
+            errno = EBUSY;
+            return -1;
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+}
+
+/*
+ * hs_unlock() - Release lock
+ *
+ * Releases exclusive lock held, or shared lock if no exclusive lock is
+ * held. Fails with errno EINVAL if no lock is held.
+ *
+ */
+
+int hs_unlock(hs_client_t client, int timeout)
+{
+    session_t *s = &session[client];
+    int response;
+
+    // Release takes place after most recently sent message
+    response = client_lock_transact(client, CC_RELEASE, s->message_id - 2, NULL, 0, timeout);
+    if (response < 0)
+    {
+        error_printf("AsyncLock failed\n");
+        return -1;
+    }
+
+    if (response == CC_RELEASE_RSP_SUCCESS_ERROR)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * hs_lock_info() - Get lock information
+ *
+ * Tells if an exclusive lock is granted and how many clients hold locks.
+ *
+ */
+
+int hs_lock_info(hs_client_t client, bool *exclusive, int *holders, int timeout)
+{
+    msg_header_t msg_header;
+
+    if (client_transact(client, AsyncLockInfo, 0, 0, NULL, 0,
+                AsyncLockInfoResponse, &msg_header, NULL, 0, timeout) != 0)
+    {
+        error_printf("AsyncLockInfo failed\n");
+        return -1;
+    }
+
+    *exclusive = msg_header.control_code == CC_INFO_RSP_EXCLUSIVE_LOCK;
+    *holders = msg_header.parameter;
+
+    return 0;
+}
+
+/*
+ * hs_send() - Send message
+ *
+ * Sends message on the sync channel without waiting for a response, so
+ * several requests can be in flight at once. The message is split into Data
+ * messages terminated by DataEnd if larger than the server accepts. Returns
+ * MessageID of the final DataEnd in message_id if not NULL.
+ *
+ */
+
+int hs_send(hs_client_t client, void *message, int length, uint32_t *message_id, int timeout)
+{
+    session_t *s = &session[client];
+    client_session_t *cs = &client_session[client];
+    struct iovec iov[2];
+    uint8_t header[MSG_HEADER_SIZE];
+    uint64_t fragment_size_max, fragment_size;
+    uint64_t remaining = length;
+    char *data = message;
+    uint8_t control_code;
+
+    fragment_size_max = client_fragment_size_max(s);
+
+    do
+    {
+        fragment_size = (remaining > fragment_size_max) ? fragment_size_max : remaining;
+        remaining -= fragment_size;
+
+        // Only first message after a delivered response carries RMT-delivered
+        control_code = __atomic_exchange_n(&cs->rmt_delivered, false, __ATOMIC_RELAXED) ?
+            CC_RMT_DELIVERED : 0;
+
+        msg_header_encode(header, (remaining > 0) ? Data : DataEnd, control_code,
+                s->message_id, fragment_size);
+        iov[0].iov_base = header;
+        iov[0].iov_len = MSG_HEADER_SIZE;
+        iov[1].iov_base = data;
+        iov[1].iov_len = fragment_size;
+
+        if (tcp_writev(s->socket_sync, iov, 2, timeout) < 0)
+            return -1;
+
+        cs->message_id_sent = s->message_id;
+        s->message_id += 2;
+        data += fragment_size;
+    }
+    while (remaining > 0);
+
+    if (message_id != NULL)
+        *message_id = cs->message_id_sent;
+
+    return 0;
+}
+
+/*
+ * hs_receive() - Receive response
+ *
+ * Waits for the next complete response on the sync channel and copies it to
+ * buffer. Responses are delivered in the order requests were sent. In
+ * synchronized mode responses not belonging to the most recently sent
+ * message are discarded. Returns response length, or -1 on error. A response
+ * larger than capacity is consumed and fails with errno set to EMSGSIZE.
+ * Fails with errno EBUSY while the client event loop receives responses of
+ * the session, see hs_send_receive_async().
+ *
+ */
+
+int hs_receive(hs_client_t client, void *buffer, int capacity, uint32_t *message_id, int timeout)
+{
+    session_t *s = &session[client];
+    client_session_t *cs = &client_session[client];
+    uint8_t header[MSG_HEADER_SIZE];
+    msg_header_t msg_header;
+    uint64_t length = 0, chunk;
+    bool truncated = false, attached;
+    char error[256];
+
+    // Event loop owns sync channel input of attached sessions
+    pthread_mutex_lock(&cs->async.mutex);
+    attached = cs->async.pending != NULL;
+    pthread_mutex_unlock(&cs->async.mutex);
+
+    if (attached)
+    {
+        error_printf("Session receives asynchronously\n");
+        errno = EBUSY;
+        return -1;
+    }
+
+    while (true)
+    {
+        if (client_read(s->socket_sync, &cs->receive, header, MSG_HEADER_SIZE, timeout) != 0)
+            return -1;
+
+        msg_header_decode(&msg_header, header);
+        if (msg_header_verify(&msg_header))
+            return -1;
+
+        switch (msg_header.type)
+        {
+            case Data:
+            case DataEnd:
+                // Synchronized mode drops stale responses and buffered data
+                if ((!s->overlap) &&
+                    (msg_header.parameter != cs->message_id_sent) &&
+                    ((msg_header.type == DataEnd) || (msg_header.parameter != MSG_ID_UNKNOWN)))
+                {
+                    if (client_skip(s->socket_sync, &cs->receive, msg_header.payload_length, timeout) != 0)
+                        return -1;
+                    length = 0;
+                    truncated = false;
+                    break;
+                }
+
+                chunk = msg_header.payload_length;
+                if (length + chunk > (uint64_t) capacity)
+                {
+                    chunk = capacity - length;
+                    truncated = true;
+                }
+
+                if (client_read(s->socket_sync, &cs->receive, (char *) buffer + length, chunk, timeout) != 0)
+                    return -1;
+                if (client_skip(s->socket_sync, &cs->receive, msg_header.payload_length - chunk, timeout) != 0)
+                    return -1;
+                length += chunk;
+
+                if (msg_header.type == DataEnd)
+                {
+                    cs->rmt_delivered = true;
+                    s->message_id_received = msg_header.parameter;
+
+                    if (message_id != NULL)
+                        *message_id = msg_header.parameter;
+
+                    if (truncated)
+                    {
+                        error_printf("Response too large for buffer\n");
+                        errno = EMSGSIZE;
+                        return -1;
+                    }
+
+                    return length;
+                }
+                break;
+
+            case Interrupted:
+                // Pending response was abandoned by server
+                length = 0;
+                truncated = false;
+                break;
+
+            case Error:
+            case FatalError:
+                chunk = (msg_header.payload_length < sizeof(error)) ?
+                    msg_header.payload_length : sizeof(error) - 1;
+                if ((client_read(s->socket_sync, &cs->receive, error, chunk, timeout) != 0) ||
+                    (client_skip(s->socket_sync, &cs->receive, msg_header.payload_length - chunk, timeout) != 0))
+                    return -1;
+                error[chunk] = 0;
+                error_printf("Server error %d: %s\n", msg_header.control_code, error);
+                if (msg_header.type == FatalError)
+                    return -1;
+                break;
+
+            default:
+                if (client_skip(s->socket_sync, &cs->receive, msg_header.payload_length, timeout) != 0)
+                    return -1;
+                break;
+        }
+    }
+}
+
+/*
+ * hs_send_receive_sync() - Send message and wait for response
+ *
+ * Performs one request/response round trip on the sync channel. Response is
+ * copied to caller supplied buffer. Header is built on the stack and sent
+ * together with the message in one vectored write, and the response is read
+ * through the session receive buffer, so no memory is allocated per call.
+ * Returns response length or -1 on error.
+ *
+ */
+
+int hs_send_receive_sync(hs_client_t client, void *message, int length,
+        void *response, int capacity, int timeout)
+{
+    if (hs_send(client, message, length, NULL, timeout) != 0)
+        return -1;
+
+    return hs_receive(client, response, capacity, NULL, timeout);
+}
+
+/*
+ * client_async_complete() - Complete oldest pending request
+ *
+ * Runs callback without session lock held so it may issue new requests or
+ * disconnect. Returns -1 if session was detached meanwhile. Caller must hold
+ * session lock.
+ *
+ */
+
+static int client_async_complete(hs_client_t client, void *response, int length)
+{
+    client_async_t *a = &client_session[client].async;
+    client_pending_t pending = a->pending[a->pending_head];
+    uint32_t generation = a->generation;
+
+    a->pending_head = (a->pending_head + 1) % CLIENT_ASYNC_DEPTH;
+    a->pending_count--;
+
+    pthread_mutex_unlock(&a->mutex);
+    pending.callback(client, response, length, pending.data);
+    pthread_mutex_lock(&a->mutex);
+
+    return (a->generation == generation) ? 0 : -1;
+}
+
+/*
+ * client_async_message() - Handle complete message received
+ *
+ * Returns -1 on fatal error or if session was detached by callback.
+ *
+ */
+
+static int client_async_message(hs_client_t client)
+{
+    session_t *s = &session[client];
+    client_session_t *cs = &client_session[client];
+    client_async_t *a = &cs->async;
+    msg_header_t *msg_header = &a->msg_header;
+    int status;
+
+    switch (msg_header->type)
+    {
+        case Data:
+        case DataEnd:
+            // Stale response clears any data buffered
+            if (a->discard)
+            {
+                a->response_length = 0;
+                break;
+            }
+
+            a->response_length += msg_header->payload_length;
+            if (msg_header->type == Data)
+                break;
+
+            s->message_id_received = msg_header->parameter;
+            __atomic_store_n(&cs->rmt_delivered, true, __ATOMIC_RELAXED);
+            status = client_async_complete(client, a->response, a->response_length);
+            a->response_length = 0;
+            return status;
+
+        case Interrupted:
+            // Pending response was abandoned by server
+            a->response_length = 0;
+            break;
+
+        case Error:
+            error_printf("Server error %d\n", msg_header->control_code);
+            break;
+
+        case FatalError:
+            error_printf("Server fatal error %d\n", msg_header->control_code);
+            return -1;
+
+        default:
+            break;
+    }
+
+    return 0;
+}
+
+/*
+ * client_async_input() - Process data available on sync channel
+ *
+ * Does a single non-blocking read into the session receive buffer and
+ * handles all messages that are complete. Messages need not fit the
+ * receive buffer, payload is copied out as it arrives. Caller must hold
+ * session lock.
+ *
+ */
+
+static int client_async_input(hs_client_t client)
+{
+    session_t *s = &session[client];
+    client_session_t *cs = &client_session[client];
+    client_async_t *a = &cs->async;
+    msg_header_t *msg_header = &a->msg_header;
+    uint8_t header[MSG_HEADER_SIZE];
+    uint64_t remaining, size;
+    size_t available, length;
+    void *pointer;
+    int status;
+
+    pointer = ring_write_pointer(&cs->receive, &available);
+    status = tcp_read(s->socket_sync, pointer, available, -1);
+    if (status == 0)
+        return -1;
+    if (status < 0)
+        return ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) ? 0 : -1;
+    ring_write_commit(&cs->receive, status);
+
+    while (true)
+    {
+        if (!a->header_valid)
+        {
+            if (ring_used(&cs->receive) < MSG_HEADER_SIZE)
+                return 0;
+
+            ring_read(&cs->receive, header, MSG_HEADER_SIZE);
+            msg_header_decode(msg_header, header);
+            if (msg_header_verify(msg_header))
+                return -1;
+
+            a->header_valid = true;
+            a->received = 0;
+            a->discard = true;
+
+            if ((msg_header->type == Data) || (msg_header->type == DataEnd))
+            {
+                // Synchronized mode responses must answer oldest request
+                a->discard = (a->pending_count == 0) ||
+                    ((!s->overlap) &&
+                     (msg_header->parameter != a->pending[a->pending_head].message_id) &&
+                     ((msg_header->type == DataEnd) || (msg_header->parameter != MSG_ID_UNKNOWN)));
+
+                // Make room for payload
+                size = a->response_length + msg_header->payload_length;
+                if ((!a->discard) && (size > a->response_size))
+                {
+                    pointer = realloc(a->response, size);
+                    if (pointer == NULL)
+                    {
+                        error_printf("realloc() failed\n");
+                        return -1;
+                    }
+                    a->response = pointer;
+                    a->response_size = size;
+                }
+            }
+        }
+
+        // Copy out or drop payload received so far
+        remaining = msg_header->payload_length - a->received;
+        length = (remaining > ring_used(&cs->receive)) ? ring_used(&cs->receive) : remaining;
+        if (a->discard)
+            ring_skip(&cs->receive, length);
+        else
+            ring_read(&cs->receive, a->response + a->response_length + a->received, length);
+        a->received += length;
+
+        if (a->received < msg_header->payload_length)
+            return 0;
+
+        a->header_valid = false;
+        if (client_async_message(client) != 0)
+            return -1;
+    }
+}
+
+/*
+ * client_async_fail() - Fail all pending requests
+ *
+ * Caller must hold session lock.
+ *
+ */
+
+static void client_async_fail(hs_client_t client)
+{
+    client_async_t *a = &client_session[client].async;
+
+    while (a->pending_count > 0)
+    {
+        if (client_async_complete(client, NULL, -1) != 0)
+            return;
+    }
+}
+
+/*
+ * client_srq_input() - Read messages on idle async channel
+ *
+ * Reads what has arrived on the async channel while no transaction holds
+ * it, which is service requests and the response of a lock request. Status is set to the status byte of
+ * the latest service request read. Returns -1 if channel failed. Caller
+ * must hold channel.
+ *
+ */
+
+static int client_srq_input(hs_client_t client, int *status)
+{
+    session_t *s = &session[client];
+    struct pollfd pfd = { .fd = s->socket_async, .events = POLLIN };
+    uint8_t header[MSG_HEADER_SIZE];
+    msg_header_t msg_header;
+    int result = 0;
+
+    // Transaction may have consumed input since socket became readable
+    while (poll(&pfd, 1, 0) > 0)
+    {
+        if (client_read(s->socket_async, NULL, header, MSG_HEADER_SIZE, CLIENT_SRQ_TIMEOUT) != 0)
+        {
+            result = -1;
+            break;
+        }
+
+        msg_header_decode(&msg_header, header);
+        if ((msg_header_verify(&msg_header) != 0) ||
+            (client_skip(s->socket_async, NULL, msg_header.payload_length, CLIENT_SRQ_TIMEOUT) != 0))
+        {
+            result = -1;
+            break;
+        }
+
+        if (msg_header.type == AsyncServiceRequest)
+            *status = msg_header.control_code;
+        else if (msg_header.type == AsyncLockResponse)
+            client_lock_deliver(client, msg_header.control_code);
+        else
+            error_printf("Unexpected message type %d received\n", msg_header.type);
+    }
+
+    return result;
+}
+
+static void client_srq_event(hs_client_t client)
+{
+    session_t *s = &session[client];
+    client_async_t *a = &client_session[client].async;
+    struct epoll_event event;
+    int srq = -1, status;
+
+    pthread_mutex_lock(&a->mutex);
+
+    // Ignore events for sessions detached meanwhile
+    if (!a->srq_attached)
+    {
+        pthread_mutex_unlock(&a->mutex);
+        return;
+    }
+
+    // Transaction holding channel reads it, and rearms event loop when done
+    if (pthread_mutex_trylock(&a->channel_mutex) != 0)
+    {
+        a->srq_deferred = true;
+        pthread_mutex_unlock(&a->mutex);
+        return;
+    }
+
+    a->srq_busy = true;
+    a->srq_thread = pthread_self();
+
+    pthread_mutex_unlock(&a->mutex);
+
+    status = client_srq_input(client, &srq);
+    pthread_mutex_unlock(&a->channel_mutex);
+    client_srq_deliver(client, srq);
+
+    pthread_mutex_lock(&a->mutex);
+
+    if (a->srq_attached)
+    {
+        if (status != 0)
+        {
+            // Connection is unusable, stop servicing it
+            epoll_ctl(client_loop.epoll, EPOLL_CTL_DEL, s->socket_async, NULL);
+            a->srq_attached = false;
+            pthread_cond_broadcast(&a->lock_cond);
+        }
+        else
+        {
+            event.events = EPOLLIN | EPOLLONESHOT;
+            event.data.u64 = CLIENT_LOOP_SRQ | client;
+            epoll_ctl(client_loop.epoll, EPOLL_CTL_MOD, s->socket_async, &event);
+        }
+    }
+
+    a->srq_busy = false;
+    pthread_cond_broadcast(&a->idle);
+    pthread_mutex_unlock(&a->mutex);
+}
+
+static void *client_loop_thread(void *arg)
+{
+    struct epoll_event events[CLIENT_LOOP_EVENTS_MAX];
+    struct epoll_event event;
+    client_async_t *a;
+    hs_client_t client;
+    uint32_t generation;
+    int i, n;
+
+    while (true)
+    {
+        n = epoll_wait(client_loop.epoll, events, CLIENT_LOOP_EVENTS_MAX, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            error_printf("epoll_wait() failed\n");
+            return NULL;
+        }
+
+        for (i=0; i<n; i++)
+        {
+            if (events[i].data.u64 & CLIENT_LOOP_SRQ)
+            {
+                client_srq_event(events[i].data.u64 & ~CLIENT_LOOP_SRQ);
+                continue;
+            }
+
+            client = events[i].data.u64 & 0xffffffff;
+            generation = events[i].data.u64 >> 32;
+            a = &client_session[client].async;
+
+            pthread_mutex_lock(&a->mutex);
+
+            // Ignore events for sessions detached meanwhile
+            if ((!a->attached) || (a->generation != generation))
+            {
+                pthread_mutex_unlock(&a->mutex);
+                continue;
+            }
+
+            a->busy = true;
+            a->thread = pthread_self();
+
+            if (client_async_input(client) != 0)
+            {
+                // Connection is unusable, stop servicing it
+                if (a->generation == generation)
+                {
+                    epoll_ctl(client_loop.epoll, EPOLL_CTL_DEL, session[client].socket_sync, NULL);
+                    a->attached = false;
+                    client_async_fail(client);
+                }
+            }
+            else
+            {
+                // One-shot registration keeps session on a single loop thread
+                event.events = EPOLLIN | EPOLLONESHOT;
+                event.data.u64 = events[i].data.u64;
+                epoll_ctl(client_loop.epoll, EPOLL_CTL_MOD, session[client].socket_sync, &event);
+            }
+
+            a->busy = false;
+            pthread_cond_broadcast(&a->idle);
+            pthread_mutex_unlock(&a->mutex);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * hs_client_loop_init() - Start client event loop
+ *
+ * Starts threads servicing responses of all sessions used asynchronously.
+ * Optional, a single thread is started on first asynchronous request.
+ *
+ */
+
+int hs_client_loop_init(int threads)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    int i, status = 0;
+
+    pthread_once(&client_once, client_init);
+    pthread_mutex_lock(&client_loop.mutex);
+
+    if (client_loop.epoll >= 0)
+        goto out;
+
+    client_loop.epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (client_loop.epoll < 0)
+    {
+        error_printf("epoll_create1() failed\n");
+        status = -1;
+        goto out;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (i=0; i<threads; i++)
+    {
+        if (pthread_create(&thread, &attr, client_loop_thread, NULL) != 0)
+        {
+            error_printf("pthread_create() failed\n");
+            status = -1;
+            break;
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+
+out:
+    pthread_mutex_unlock(&client_loop.mutex);
+    return status;
+}
+
+static int client_async_attach(hs_client_t client)
+{
+    session_t *s = &session[client];
+    client_async_t *a = &client_session[client].async;
+    struct epoll_event event;
+
+    if (hs_client_loop_init(1) != 0)
+        return -1;
+
+    a->pending = malloc(CLIENT_ASYNC_DEPTH * sizeof(client_pending_t));
+    if (a->pending == NULL)
+    {
+        error_printf("malloc() failed\n");
+        return -1;
+    }
+    a->pending_head = 0;
+    a->pending_count = 0;
+    a->header_valid = false;
+    a->response = NULL;
+    a->response_length = 0;
+    a->response_size = 0;
+
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.u64 = ((uint64_t) a->generation << 32) | client;
+    if (epoll_ctl(client_loop.epoll, EPOLL_CTL_ADD, s->socket_sync, &event) != 0)
+    {
+        error_printf("epoll_ctl() failed\n");
+        free(a->pending);
+        a->pending = NULL;
+        return -1;
+    }
+
+    a->attached = true;
+
+    return 0;
+}
+
+static int client_async_detach(hs_client_t client)
+{
+    client_async_t *a = &client_session[client].async;
+
+    pthread_mutex_lock(&a->mutex);
+
+    if (a->pending == NULL)
+    {
+        pthread_mutex_unlock(&a->mutex);
+        return 0;
+    }
+
+    // Wait for event loop unless called from one of its callbacks
+    while (a->busy && !pthread_equal(a->thread, pthread_self()))
+        pthread_cond_wait(&a->idle, &a->mutex);
+
+    if (a->attached)
+        epoll_ctl(client_loop.epoll, EPOLL_CTL_DEL, session[client].socket_sync, NULL);
+    a->attached = false;
+
+    client_async_fail(client);
+
+    a->generation++;
+    free(a->pending);
+    free(a->response);
+    a->pending = NULL;
+    a->response = NULL;
+
+    pthread_mutex_unlock(&a->mutex);
+
+    return 0;
+}
+
+static void client_srq_detach(hs_client_t client)
+{
+    client_async_t *a = &client_session[client].async;
+
+    pthread_mutex_lock(&a->mutex);
+
+    // Wait for event loop unless called from service request callback
+    while (a->srq_busy && !pthread_equal(a->srq_thread, pthread_self()))
+        pthread_cond_wait(&a->idle, &a->mutex);
+
+    if (a->srq_attached)
+        epoll_ctl(client_loop.epoll, EPOLL_CTL_DEL, session[client].socket_async, NULL);
+    a->srq_attached = false;
+    a->srq_callback = NULL;
+    a->srq_data = NULL;
+    pthread_cond_broadcast(&a->lock_cond);
+
+    pthread_mutex_unlock(&a->mutex);
+}
+
+/*
+ * hs_set_srq_callback() - Set service request callback
+ *
+ * Registers callback receiving the status byte of every AsyncServiceRequest
+ * the server sends, so service requests need not be polled for. From then
+ * on the client event loop watches the async channel. Status passed is
+ * the status byte the server had when sending, RQS stays set in the server
+ * until read with hs_status_query(). A NULL callback drops service requests.
+ *
+ */
+
+int hs_set_srq_callback(hs_client_t client, hs_srq_callback_t callback, void *data)
+{
+    session_t *s = &session[client];
+    client_async_t *a = &client_session[client].async;
+    struct epoll_event event;
+    int status = 0;
+
+    if (hs_client_loop_init(1) != 0)
+        return -1;
+
+    pthread_mutex_lock(&a->mutex);
+
+    a->srq_callback = callback;
+    a->srq_data = data;
+
+    // Channel watched for a lock request stays watched
+    a->lock_watch = false;
+
+    if (!a->srq_attached)
+    {
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.u64 = CLIENT_LOOP_SRQ | client;
+        if (epoll_ctl(client_loop.epoll, EPOLL_CTL_ADD, s->socket_async, &event) != 0)
+        {
+            error_printf("epoll_ctl() failed\n");
+            status = -1;
+        }
+        else
+            a->srq_attached = true;
+    }
+
+    pthread_mutex_unlock(&a->mutex);
+
+    return status;
+}
+
+/*
+ * hs_send_receive_async() - Send message and get response by callback
+ *
+ * Sends message on the sync channel and returns without waiting for the
+ * response, which is delivered to callback from the client event loop.
+ * Requests are answered in the order sent and up to CLIENT_ASYNC_DEPTH may
+ * be in flight per session, beyond that the call fails with errno EAGAIN.
+ * Timeout applies to sending. Once the request is registered the call
+ * returns 0 and any failure, including failure to send, is reported by
+ * calling callback with length -1, from the calling thread if sending
+ * failed. Once used asynchronously responses on a session can not be read
+ * with hs_receive() until hs_device_clear() returns it to synchronous use.
+ *
+ */
+
+int hs_send_receive_async(hs_client_t client, void *message, int length, int timeout,
+        hs_receive_callback_t callback, void *data)
+{
+    session_t *s = &session[client];
+    client_async_t *a = &client_session[client].async;
+    uint64_t fragment_size_max = client_fragment_size_max(s);
+    uint64_t fragments = (length > 0) ? (length + fragment_size_max - 1) / fragment_size_max : 1;
+    client_pending_t *pending;
+    bool withdrawn = false;
+    int status = 0;
+
+    pthread_mutex_lock(&a->send_mutex);
+    pthread_mutex_lock(&a->mutex);
+
+    if ((a->pending == NULL) && (client_async_attach(client) != 0))
+    {
+        status = -1;
+        goto out;
+    }
+
+    if ((!a->attached) || (a->pending_count == CLIENT_ASYNC_DEPTH))
+    {
+        errno = a->attached ? EAGAIN : ENOTCONN;
+        status = -1;
+        goto out;
+    }
+
+    // Register request before sending since response may arrive at once
+    pending = &a->pending[(a->pending_head + a->pending_count) % CLIENT_ASYNC_DEPTH];
+    pending->callback = callback;
+    pending->data = data;
+    pending->message_id = s->message_id + 2 * (fragments - 1);
+    a->pending_count++;
+
+    pthread_mutex_unlock(&a->mutex);
+
+    status = hs_send(client, message, length, NULL, timeout);
+
+    pthread_mutex_lock(&a->mutex);
+
+    // Withdraw request not sent, unless already failed by event loop.
+    // Registered request is reported through callback only.
+    withdrawn = (status != 0) && (a->attached) && (a->pending_count > 0);
+    if (withdrawn)
+        a->pending_count--;
+    status = 0;
+
+out:
+    pthread_mutex_unlock(&a->mutex);
+    pthread_mutex_unlock(&a->send_mutex);
+
+    if (withdrawn)
+        callback(client, NULL, -1, data);
+
+    return status;
+}
+
+static void client_group_put(client_group_t *group)
+{
+    if (--group->refs > 0)
+    {
+        pthread_mutex_unlock(&group->mutex);
+        return;
+    }
+
+    pthread_mutex_unlock(&group->mutex);
+    pthread_mutex_destroy(&group->mutex);
+    pthread_cond_destroy(&group->done);
+    free(group);
+}
+
+static void client_group_callback(hs_client_t client, void *response, int length, void *data)
+{
+    client_group_entry_t *entry = data;
+    client_group_t *group = entry->group;
+    hs_group_member_t *member;
+
+    pthread_mutex_lock(&group->mutex);
+
+    // Caller has stopped waiting, members are no longer ours to touch
+    if (group->expired)
+    {
+        client_group_put(group);
+        return;
+    }
+
+    member = &group->members[entry->index];
+    if (length < 0)
+    {
+        member->status = -1;
+        member->error = EIO;
+    }
+    else if (length > member->capacity)
+    {
+        member->status = -1;
+        member->error = EMSGSIZE;
+    }
+    else
+    {
+        memcpy(member->response, response, length);
+        member->status = length;
+        member->error = 0;
+    }
+
+    if (--group->outstanding == 0)
+        pthread_cond_signal(&group->done);
+
+    client_group_put(group);
+}
+
+/*
+ * hs_group_send_receive() - Send commands to group and gather responses
+ *
+ * Sends a command to every member, either its own or the group message, and
+ * waits until all members have responded or timeout ms have passed (0 waits
+ * forever). Requests go out on all sessions before any response is awaited
+ * so the total time tracks the slowest member. Per member result is stored
+ * in status and error. Returns 0 if all members succeeded, otherwise -1.
+ * Sessions not already used with hs_send_receive_async() are returned to
+ * synchronous use once the group completes, responses still underway then
+ * are dropped in synchronized mode.
+ *
+ */
+
+int hs_group_send_receive(hs_group_member_t *members, int count, void *message, int length, int timeout)
+{
+    client_group_t *group;
+    client_async_t *a;
+    struct timespec deadline, now;
+    long remaining;
+    int i, status = 0;
+
+    group = malloc(sizeof(client_group_t) + count * sizeof(client_group_entry_t));
+    if (group == NULL)
+    {
+        error_printf("malloc() failed\n");
+        return -1;
+    }
+
+    pthread_mutex_init(&group->mutex, NULL);
+    pthread_cond_init(&group->done, NULL);
+    group->members = members;
+    group->outstanding = count;
+    group->refs = count + 1;
+    group->expired = false;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    // Sessions attached for the group only are detached again afterwards
+    for (i=0; i<count; i++)
+    {
+        a = &client_session[members[i].client].async;
+        pthread_mutex_lock(&a->mutex);
+        group->entry[i].detach = (a->pending == NULL);
+        pthread_mutex_unlock(&a->mutex);
+    }
+
+    // Scatter
+    for (i=0; i<count; i++)
+    {
+        members[i].status = -1;
+        members[i].error = ETIMEDOUT;
+        group->entry[i].group = group;
+        group->entry[i].index = i;
+
+        // Sending to member may only take what is left until group deadline
+        remaining = 0;
+        if (timeout > 0)
+        {
+            clock_gettime(CLOCK_REALTIME, &now);
+            remaining = (deadline.tv_sec - now.tv_sec) * 1000 +
+                (deadline.tv_nsec - now.tv_nsec) / 1000000;
+        }
+
+        if ((timeout > 0) && (remaining <= 0))
+            errno = ETIMEDOUT;
+        else if (hs_send_receive_async(members[i].client,
+                    members[i].message ? members[i].message : message,
+                    members[i].message ? members[i].length : length,
+                    remaining, client_group_callback, &group->entry[i]) == 0)
+            continue;
+
+        // Member not sent to has no callback coming
+        pthread_mutex_lock(&group->mutex);
+        members[i].error = errno;
+        group->outstanding--;
+        group->refs--;
+        pthread_mutex_unlock(&group->mutex);
+    }
+
+    // Gather
+    pthread_mutex_lock(&group->mutex);
+
+    while (group->outstanding > 0)
+    {
+        if (timeout == 0)
+            pthread_cond_wait(&group->done, &group->mutex);
+        else if (pthread_cond_timedwait(&group->done, &group->mutex, &deadline) == ETIMEDOUT)
+            break;
+    }
+
+    group->expired = true;
+
+    for (i=0; i<count; i++)
+    {
+        if (members[i].status < 0)
+            status = -1;
+    }
+
+    // Detaching fails requests still pending, their callbacks take the lock
+    pthread_mutex_unlock(&group->mutex);
+
+    for (i=0; i<count; i++)
+    {
+        if (group->entry[i].detach)
+            client_async_detach(members[i].client);
+    }
+
+    pthread_mutex_lock(&group->mutex);
+    client_group_put(group);
+
+    return status;
+}
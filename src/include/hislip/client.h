@@ -31,13 +31,66 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
+#include <stdint.h>
+#include <stdbool.h>
+
 typedef int hs_client_t;
 
+// Called from client event loop when response arrives. Length is -1 if the
+// request failed. Response buffer is only valid until callback returns.
+typedef void (*hs_receive_callback_t)(hs_client_t client, void *response, int length, void *data);
+
+// Called from client event loop, or from a thread done with a transaction on
+// the async channel, when server requests service. Status is the status byte.
+typedef void (*hs_srq_callback_t)(hs_client_t client, uint8_t status, void *data);
+
+// Server to connect to, see hs_connect_many()
+typedef struct
+{
+    char *address;
+    int port;
+    char *subaddress;
+
+    // Client handle, or -1 with error set to errno value on failure
+    hs_client_t client;
+    int error;
+} hs_connect_target_t;
+
+// Member of a group request, see hs_group_send_receive()
+typedef struct
+{
+    hs_client_t client;
+
+    // Command sent to member, group message is used if NULL
+    void *message;
+    int length;
+
+    // Response buffer supplied by caller
+    void *response;
+    int capacity;
+
+    // Response length, or -1 with error set to errno value on failure
+    int status;
+    int error;
+} hs_group_member_t;
+
 /* Client API */
 hs_client_t hs_connect(char *address, int port, char *subaddress, int timeout);
-int hs_send_receive_sync(hs_client_t client, void *message, int *length, int timeout);
-int hs_send_receive_async(hs_client_t client, void *message, int length, int timeout, void (*receive_callback)(void *message, int length));
-int hs_send_response(int message_id, void *message, int length);
+int hs_connect_many(hs_connect_target_t *targets, int count, int timeout);
+int hs_send_receive_sync(hs_client_t client, void *message, int length, void *response, int capacity, int timeout);
+int hs_send_receive_async(hs_client_t client, void *message, int length, int timeout, hs_receive_callback_t callback, void *data);
+int hs_client_loop_init(int threads);
+int hs_group_send_receive(hs_group_member_t *members, int count, void *message, int length, int timeout);
 int hs_disconnect(hs_client_t client);
+int hs_send(hs_client_t client, void *message, int length, uint32_t *message_id, int timeout);
+int hs_receive(hs_client_t client, void *buffer, int capacity, uint32_t *message_id, int timeout);
+int hs_set_max_message_size(hs_client_t client, uint64_t size, int timeout);
+uint64_t hs_get_max_message_size(hs_client_t client);
+int hs_status_query(hs_client_t client, uint8_t *status, int timeout);
+int hs_device_clear(hs_client_t client, int timeout);
+int hs_set_srq_callback(hs_client_t client, hs_srq_callback_t callback, void *data);
+int hs_lock(hs_client_t client, char *key, int lock_timeout, int timeout);
+int hs_unlock(hs_client_t client, int timeout);
+int hs_lock_info(hs_client_t client, bool *exclusive, int *holders, int timeout);
 
 #endif
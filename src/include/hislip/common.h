@@ -36,4 +36,7 @@
 #define HISLIP_VERSION_MINOR 0
 #define HISLIP_VENDOR_ID 42
 
+// Connect to this address to reach a server using the local transport
+#define HS_LOOPBACK_ADDRESS "loopback"
+
 #endif
@@ -32,49 +32,191 @@
 #define SERVER_H
 
 #include <sys/queue.h>
+#include <sys/uio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Request handle passed to message callbacks. The request and its message
+// buffer are only valid until the callback returns unless the callback takes
+// a lease with hs_request_retain() and returns it with hs_request_release().
+typedef struct hs_request_t hs_request_t;
+
+// Session handle (SessionID), outlives requests of session
+typedef uint16_t hs_session_t;
+
+// Stream chunk flags
+#define HS_STREAM_START 0x1 // First chunk of message
+#define HS_STREAM_END   0x2 // Last chunk of message (DataEnd received)
 
 typedef struct
 {
-    int (*message_sync)(void *buffer, int length);
-    int (*message_async)(void *buffer, int length);
+    int (*message_sync)(hs_request_t *request, void *buffer, int length);
+    int (*message_async)(hs_request_t *request, void *buffer, int length);
+
+    // If set, Data/DataEnd payloads are delivered in chunks of up to
+    // stream_chunk_size bytes as they arrive instead of as complete messages
+    // of up to payload_size_max bytes
+    int (*message_stream)(hs_request_t *request, void *buffer, int length, int flags);
 
 } hs_subaddress_callbacks_t;
 
+// Opaque lock manager
+typedef struct hs_lock_t hs_lock_t;
+
 typedef struct hs_subaddress_data_t
 {
     char *subaddress;
     hs_subaddress_callbacks_t *callbacks;
+    int index; // Statistics slot
+    hs_lock_t *lock; // AsyncLock state shared by sessions of subaddress
     LIST_ENTRY(hs_subaddress_data_t) entries;
 
 } hs_subaddress_data_t;
 
+typedef enum
+{
+    HS_IO_THREADED, // One thread per connection
+    HS_IO_EPOLL,    // Connections multiplexed on epoll event loop threads
+    HS_IO_URING     // As HS_IO_EPOLL but driven by io_uring, falls back to
+                    // epoll if io_uring is not available
+
+} hs_io_mode_t;
+
 typedef struct
 {
     int port;
     int connections_max;
+    int sessions_max; // Capacity of session table (per shard, at most 32768 with one shard)
+    int shards; // Independent SO_REUSEPORT listeners (event loop modes only)
     int worker_threads_max;
     int worker_queue_depth_max;
     int payload_size_max;
     int message_timeout;
+    hs_io_mode_t io_mode;
+    int io_threads_max;
+    int stream_chunk_size;
+    bool overlap_mode; // Initial mode, overlapped (true) or synchronized (false)
+    bool loopback; // Serve local transport (HS_LOOPBACK_ADDRESS) instead of TCP
 
 } hs_server_config_t;
 
+// Opaque server shard
+typedef struct hs_server_shard_t hs_server_shard_t;
+
+// Opaque per-thread statistics
+typedef struct hs_stats_t hs_stats_t;
+
+#define HS_STATS_MESSAGE_TYPES 27 // Message types 0-25, last entry counts any other type
+
+// Bucket 0 counts callbacks taking less than 1 us, bucket i those taking
+// 2^(i-1) to 2^i us and the last bucket all slower ones
+#define HS_STATS_HISTOGRAM_BUCKETS 24
+
+typedef struct
+{
+    // Per message type (msg_type_t) counters
+    uint64_t messages_in[HS_STATS_MESSAGE_TYPES];
+    uint64_t bytes_in[HS_STATS_MESSAGE_TYPES];
+    uint64_t messages_out[HS_STATS_MESSAGE_TYPES];
+    uint64_t bytes_out[HS_STATS_MESSAGE_TYPES];
+
+    // Message callback execution time histogram
+    uint64_t callback_time[HS_STATS_HISTOGRAM_BUCKETS];
+
+    // Server wide
+    uint64_t connections_active;
+    uint64_t sessions_active;
+    uint64_t queue_depth; // Requests waiting for a worker thread
+    uint64_t queue_full; // Requests held back because worker queue was full
+    uint64_t rejected_sessions; // Initialize refused
+    uint64_t rejected_messages; // Payload too large
+    uint64_t invalid_headers;
+    uint64_t pool_allocated_max; // Largest buffer pool of a closed connection (bytes)
+    uint64_t pool_leased_max; // Most pool bytes a closed connection had leased at once
+
+} hs_server_stats_t;
+
 typedef struct
 {
     int (*tcp_start)(int port, int n, void (*connection_callback)(int socket, void *data), void *data);
     int (*tcp_read)(int socket, void *buffer, int length, int timeout);
     int (*tcp_write)(int socket, void *buffer, int length, int timeout);
+    int (*tcp_writev)(int socket, struct iovec *iov, int iovcnt, int timeout);
     int (*tcp_close)(int socket);
 
     hs_server_config_t *config;
     hs_subaddress_data_t *subaddress_data;
 
+    // Instance state, set up by hs_server_init()
+    LIST_HEAD(, hs_subaddress_data_t) subaddresses;
+    hs_server_shard_t *shards;
+    int shards_count;
+    hs_io_mode_t io_mode; // Effective I/O mode
+    int shard_bits;
+    int subaddresses_count;
+    bool running; // Set by hs_server_run(), subaddresses are fixed
+    hs_stats_t *stats;
+
 } hs_server_t;
 
+// Message pipeline stages recorded by tracing
+typedef enum
+{
+    HS_TRACE_HEADER,         // Message header received
+    HS_TRACE_PAYLOAD,        // Message payload complete
+    HS_TRACE_ENQUEUE,        // Request queued for worker thread
+    HS_TRACE_CALLBACK_START, // Message callback started
+    HS_TRACE_CALLBACK_END,   // Message callback returned
+    HS_TRACE_RESPONSE        // Message written to connection
+
+} hs_trace_stage_t;
+
+typedef struct
+{
+    uint64_t timestamp; // CLOCK_MONOTONIC, ns
+    uint32_t message_id;
+    uint16_t session_id;
+    uint8_t type; // msg_type_t
+    uint8_t stage; // hs_trace_stage_t
+
+} hs_trace_record_t;
+
+// Trace file layout: header followed by records, host byte order
+#define HS_TRACE_FILE_MAGIC 0x52545348 // "HSTR"
+#define HS_TRACE_FILE_VERSION 1
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+
+} hs_trace_file_header_t;
+
 /* Server API */
 int hs_server_config_init(hs_server_config_t *config);
 int hs_server_init(hs_server_t *server, hs_server_config_t *config);
 int hs_server_register_subaddress(hs_server_t *server, char *subaddress, hs_subaddress_callbacks_t *callbacks);
 int hs_server_run(hs_server_t *server);
+int hs_server_get_stats(hs_server_t *server, char *subaddress, hs_server_stats_t *stats);
+int hs_send_response(hs_request_t *request, void *message, int length);
+int hs_send_responsev(hs_request_t *request, const struct iovec *iov, int iovcnt);
+int hs_request_retain(hs_request_t *request);
+int hs_request_release(hs_request_t *request);
+bool hs_request_cancelled(hs_request_t *request);
+bool hs_request_locked(hs_request_t *request, bool *exclusive);
+int hs_set_status(hs_request_t *request, uint8_t status);
+uint8_t hs_get_status(hs_request_t *request);
+int hs_service_request(hs_request_t *request, uint8_t status);
+hs_session_t hs_request_session(hs_request_t *request);
+int hs_server_set_status(hs_server_t *server, hs_session_t session, uint8_t status);
+int hs_server_get_status(hs_server_t *server, hs_session_t session, uint8_t *status);
+int hs_server_service_request(hs_server_t *server, hs_session_t session, uint8_t status);
+
+/* Tracing API */
+int hs_trace_enable(bool enable);
+int hs_trace_drain(hs_trace_record_t *records, int count);
+int hs_trace_dump(const char *filename);
+uint64_t hs_trace_dropped(void);
 
 #endif
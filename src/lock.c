@@ -0,0 +1,429 @@
+/*
+ * Copyright (c) 2017  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <hislip/server.h>
+#include "lock.h"
+#include "message.h"
+#include "error.h"
+
+static uint64_t lock_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void lock_append(hs_lock_t *lock, lock_owner_t *owner)
+{
+    owner->next = NULL;
+    owner->prev = lock->tail;
+    if (lock->tail != NULL)
+        lock->tail->next = owner;
+    else
+        lock->head = owner;
+    lock->tail = owner;
+    owner->waiting = true;
+}
+
+static void lock_unlink(hs_lock_t *lock, lock_owner_t *owner)
+{
+    if (owner->prev != NULL)
+        owner->prev->next = owner->next;
+    else
+        lock->head = owner->next;
+    if (owner->next != NULL)
+        owner->next->prev = owner->prev;
+    else
+        lock->tail = owner->prev;
+    owner->waiting = false;
+}
+
+// Collect request completed under mutex, responses are sent after unlocking
+static void lock_done(lock_owner_t **done, lock_owner_t *owner, int result)
+{
+    owner->result = result;
+    owner->next = *done;
+    *done = owner;
+}
+
+static void lock_complete(hs_lock_t *lock, lock_owner_t *done)
+{
+    lock_owner_t *next;
+
+    for (; done != NULL; done=next)
+    {
+        next = done->next;
+        lock->complete(done, done->result);
+    }
+}
+
+static bool lock_grantable(hs_lock_t *lock, lock_owner_t *owner)
+{
+    // Shared lock goes to any client with the key of shared lock granted
+    if (owner->key[0] != 0)
+        return (lock->shared == 0) ? (lock->exclusive == NULL) : (strcmp(lock->key, owner->key) == 0);
+
+    // Exclusive lock is only granted next to shared lock of its own
+    return (lock->exclusive == NULL) && ((lock->shared == 0) || owner->shared);
+}
+
+static void lock_grant(hs_lock_t *lock, lock_owner_t *owner)
+{
+    if (!owner->exclusive && !owner->shared)
+        __atomic_add_fetch(&lock->holders, 1, __ATOMIC_RELAXED);
+
+    if (owner->key[0] != 0)
+    {
+        if (lock->shared++ == 0)
+            strcpy(lock->key, owner->key);
+        owner->shared = true;
+    }
+    else
+    {
+        lock->exclusive = owner;
+        __atomic_store_n(&lock->exclusive_count, 1, __ATOMIC_RELAXED);
+        owner->exclusive = true;
+    }
+}
+
+static void lock_drop(hs_lock_t *lock, lock_owner_t *owner, bool exclusive)
+{
+    if (exclusive)
+    {
+        lock->exclusive = NULL;
+        __atomic_store_n(&lock->exclusive_count, 0, __ATOMIC_RELAXED);
+        owner->exclusive = false;
+    }
+    else
+    {
+        lock->shared--;
+        owner->shared = false;
+    }
+
+    if (!owner->exclusive && !owner->shared)
+        __atomic_sub_fetch(&lock->holders, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * lock_wake() - Grant lock to waiting requests
+ *
+ * Hands lock over to requests at head of queue as long as they can be
+ * granted, the first one that can not be granted holds back all later
+ * ones so no request is overtaken. Caller must hold mutex.
+ *
+ */
+
+static void lock_wake(hs_lock_t *lock, lock_owner_t **done)
+{
+    lock_owner_t *owner;
+
+    while ((lock->head != NULL) && lock_grantable(lock, lock->head))
+    {
+        owner = lock->head;
+        lock_unlink(lock, owner);
+        lock_grant(lock, owner);
+        lock_done(done, owner, CC_REQUEST_RSP_SUCCESS);
+    }
+}
+
+static void *lock_timer_thread(void *arg)
+{
+    hs_lock_t *lock = arg;
+    lock_owner_t *owner, *next, *done;
+    struct timespec ts;
+    uint64_t now;
+
+    pthread_mutex_lock(&lock->mutex);
+
+    while (true)
+    {
+        now = lock_now();
+        done = NULL;
+        lock->deadline = UINT64_MAX;
+
+        // Fail requests whose timeout expired, find next deadline
+        for (owner=lock->head; owner != NULL; owner=next)
+        {
+            next = owner->next;
+            if (owner->deadline <= now)
+            {
+                lock_unlink(lock, owner);
+                lock_done(&done, owner, CC_REQUEST_RSP_FAIL);
+            }
+            else if (owner->deadline < lock->deadline)
+                lock->deadline = owner->deadline;
+        }
+
+        if (done != NULL)
+        {
+            // Requests held back by expired ones may be granted now
+            lock_wake(lock, &done);
+
+            pthread_mutex_unlock(&lock->mutex);
+            lock_complete(lock, done);
+            pthread_mutex_lock(&lock->mutex);
+            continue;
+        }
+
+        if (lock->deadline == UINT64_MAX)
+            pthread_cond_wait(&lock->timer_cond, &lock->mutex);
+        else
+        {
+            ts.tv_sec = lock->deadline / 1000000000ULL;
+            ts.tv_nsec = lock->deadline % 1000000000ULL;
+            pthread_cond_timedwait(&lock->timer_cond, &lock->mutex, &ts);
+        }
+    }
+
+    return NULL;
+}
+
+static int lock_timer_start(hs_lock_t *lock)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    int status = 0;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    if (pthread_create(&thread, &attr, lock_timer_thread, lock) != 0)
+    {
+        error_printf("pthread_create() failed\n");
+        status = -1;
+    }
+    else
+        lock->timer_running = true;
+
+    pthread_attr_destroy(&attr);
+
+    return status;
+}
+
+hs_lock_t *lock_create(void (*complete)(lock_owner_t *owner, int result))
+{
+    pthread_condattr_t attr;
+    hs_lock_t *lock;
+
+    lock = calloc(1, sizeof(hs_lock_t));
+    if (lock == NULL)
+    {
+        error_printf("calloc() failed\n");
+        return NULL;
+    }
+
+    pthread_mutex_init(&lock->mutex, NULL);
+
+    // Deadlines are measured on monotonic clock
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&lock->timer_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    lock->deadline = UINT64_MAX;
+    lock->complete = complete;
+
+    return lock;
+}
+
+/*
+ * lock_request() - Request lock
+ *
+ * Requests shared lock identified by key, or exclusive lock if key is
+ * empty. A lock that is available is granted right away unless other
+ * requests are waiting for it, so requests are served first come first
+ * served. Otherwise the request waits up to timeout ms and LOCK_PENDING is
+ * returned, the response is delivered through the complete callback from
+ * the thread granting the lock or failing the request. Returns
+ * AsyncLockResponse control code otherwise.
+ *
+ */
+
+int lock_request(hs_lock_t *lock, lock_owner_t *owner, char *key, uint64_t length, uint32_t timeout)
+{
+    int result = LOCK_PENDING;
+
+    if (length > LOCK_KEY_MAX)
+    {
+        error_printf("Lock string too long\n");
+        return CC_REQUEST_RSP_ERROR;
+    }
+
+    pthread_mutex_lock(&lock->mutex);
+
+    // Redundant request, or shared one by exclusive holder that could never
+    // be granted
+    if (owner->waiting ||
+        ((length == 0) && owner->exclusive) ||
+        ((length > 0) && (owner->shared || (owner->exclusive && (lock->shared == 0)))))
+    {
+        result = CC_REQUEST_RSP_ERROR;
+        goto out;
+    }
+
+    memcpy(owner->key, key, length);
+    owner->key[length] = 0;
+
+    // Upgrade of shared lock held does not wait behind others, they may be
+    // waiting for it to be released
+    if (((lock->head == NULL) || owner->shared) && lock_grantable(lock, owner))
+    {
+        lock_grant(lock, owner);
+        result = CC_REQUEST_RSP_SUCCESS;
+        goto out;
+    }
+
+    if (timeout == 0)
+    {
+        result = CC_REQUEST_RSP_FAIL;
+        goto out;
+    }
+
+    if (!lock->timer_running && (lock_timer_start(lock) != 0))
+    {
+        result = CC_REQUEST_RSP_ERROR;
+        goto out;
+    }
+
+    owner->deadline = lock_now() + timeout * 1000000ULL;
+    lock_append(lock, owner);
+
+    if (owner->deadline < lock->deadline)
+    {
+        lock->deadline = owner->deadline;
+        pthread_cond_signal(&lock->timer_cond);
+    }
+
+out:
+    pthread_mutex_unlock(&lock->mutex);
+
+    return result;
+}
+
+/*
+ * lock_release() - Release lock
+ *
+ * Releases exclusive lock held, or shared lock if no exclusive lock is
+ * held, and grants lock to requests waiting for it. Returns
+ * AsyncLockResponse control code.
+ *
+ */
+
+int lock_release(hs_lock_t *lock, lock_owner_t *owner)
+{
+    lock_owner_t *done = NULL;
+    int result;
+
+    pthread_mutex_lock(&lock->mutex);
+
+    if (owner->exclusive)
+    {
+        lock_drop(lock, owner, true);
+        result = CC_RELEASE_RSP_SUCCESS_EXCLUSIVE;
+    }
+    else if (owner->shared)
+    {
+        lock_drop(lock, owner, false);
+        result = CC_RELEASE_RSP_SUCCESS_SHARED;
+    }
+    else
+        result = CC_RELEASE_RSP_SUCCESS_ERROR;
+
+    lock_wake(lock, &done);
+
+    pthread_mutex_unlock(&lock->mutex);
+
+    lock_complete(lock, done);
+
+    return result;
+}
+
+/*
+ * lock_close() - Release everything of owner
+ *
+ * Releases all locks held and withdraws request waiting, whose response is
+ * then never delivered. Returns true if a waiting request was withdrawn.
+ *
+ */
+
+bool lock_close(hs_lock_t *lock, lock_owner_t *owner)
+{
+    lock_owner_t *done = NULL;
+    bool withdrawn;
+
+    pthread_mutex_lock(&lock->mutex);
+
+    withdrawn = owner->waiting;
+    if (withdrawn)
+        lock_unlink(lock, owner);
+
+    if (owner->exclusive)
+        lock_drop(lock, owner, true);
+    if (owner->shared)
+        lock_drop(lock, owner, false);
+
+    lock_wake(lock, &done);
+
+    pthread_mutex_unlock(&lock->mutex);
+
+    lock_complete(lock, done);
+
+    return withdrawn;
+}
+
+/*
+ * lock_held() - Check locks of owner
+ *
+ * Returns true if owner holds the lock, exclusive tells if it holds the
+ * exclusive lock.
+ *
+ */
+
+bool lock_held(hs_lock_t *lock, lock_owner_t *owner, bool *exclusive)
+{
+    bool held;
+
+    pthread_mutex_lock(&lock->mutex);
+
+    *exclusive = owner->exclusive;
+    held = owner->exclusive || owner->shared;
+
+    pthread_mutex_unlock(&lock->mutex);
+
+    return held;
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2017  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LOCK_H
+#define LOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <hislip/server.h>
+
+#define LOCK_KEY_MAX 256 // VISA limit of lock string
+#define LOCK_PENDING -1 // Request waits, response is delivered by callback
+
+// Client taking part in locking, one per asynchronous channel
+typedef struct lock_owner_t
+{
+    // Waiting request, queue link and lock requested (empty key for
+    // exclusive lock)
+    struct lock_owner_t *next;
+    struct lock_owner_t *prev;
+    bool waiting;
+    char key[LOCK_KEY_MAX + 1];
+    uint64_t deadline;
+    int result;
+
+    // Locks held
+    bool exclusive;
+    bool shared;
+} lock_owner_t;
+
+// Lock state of a subaddress. Waiting requests are granted strictly in
+// arrival order by whoever makes the lock available, no thread polls.
+struct hs_lock_t
+{
+    pthread_mutex_t mutex;
+
+    // Lock state, exclusive_count and holders are also read without mutex
+    lock_owner_t *exclusive;
+    int exclusive_count;
+    int shared;
+    int holders;
+    char key[LOCK_KEY_MAX + 1];
+
+    // Waiting requests, oldest first
+    lock_owner_t *head;
+    lock_owner_t *tail;
+
+    // Timer thread failing requests once their timeout expires
+    pthread_cond_t timer_cond;
+    bool timer_running;
+    uint64_t deadline;
+
+    // Sends response to request that had to wait
+    void (*complete)(lock_owner_t *owner, int result);
+};
+
+hs_lock_t *lock_create(void (*complete)(lock_owner_t *owner, int result));
+int lock_request(hs_lock_t *lock, lock_owner_t *owner, char *key, uint64_t length, uint32_t timeout);
+int lock_release(hs_lock_t *lock, lock_owner_t *owner);
+bool lock_close(hs_lock_t *lock, lock_owner_t *owner);
+bool lock_held(hs_lock_t *lock, lock_owner_t *owner, bool *exclusive);
+
+static inline void lock_info(hs_lock_t *lock, bool *exclusive, int *holders)
+{
+    *exclusive = __atomic_load_n(&lock->exclusive_count, __ATOMIC_RELAXED) != 0;
+    *holders = __atomic_load_n(&lock->holders, __ATOMIC_RELAXED);
+}
+
+#endif
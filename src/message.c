@@ -33,6 +33,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <endian.h>
 #include "message.h"
 #include "error.h"
 
@@ -48,6 +49,62 @@ int msg_header_verify(msg_header_t *header)
     return 0;
 }
 
+/*
+ * msg_header_encode() - Encode message header
+ *
+ * Writes the MSG_HEADER_SIZE bytes wire format (network byte order) of a
+ * message header to buffer, so it can be sent in front of a payload without
+ * copying the payload.
+ *
+ */
+
+void msg_header_encode(
+        void *buffer,
+        msg_type_t type,
+        uint8_t control_code,
+        uint32_t parameter,
+        uint64_t payload_length)
+{
+    uint8_t *p = buffer;
+    uint16_t prologue = htobe16(MSG_HEADER_PROLOGUE);
+
+    parameter = htobe32(parameter);
+    payload_length = htobe64(payload_length);
+
+    memcpy(p, &prologue, 2);
+    p[2] = type;
+    p[3] = control_code;
+    memcpy(p + 4, &parameter, 4);
+    memcpy(p + 8, &payload_length, 8);
+}
+
+void msg_header_decode(msg_header_t *header, void *buffer)
+{
+    uint8_t *p = buffer;
+    uint16_t prologue;
+    uint32_t parameter;
+    uint64_t payload_length;
+
+    memcpy(&prologue, p, 2);
+    memcpy(&parameter, p + 4, 4);
+    memcpy(&payload_length, p + 8, 8);
+
+    header->prologue = be16toh(prologue);
+    header->type = p[2];
+    header->control_code = p[3];
+    header->parameter = be32toh(parameter);
+    header->payload_length = be64toh(payload_length);
+}
+
+/*
+ * msg_create() - Create message
+ *
+ * Allocates a single buffer holding header and a copy of payload. Only meant
+ * for small control messages, large payloads should be sent from their own
+ * buffers behind a header encoded with msg_header_encode().
+ *
+ */
+
 int msg_create(
         void **message,
         msg_type_t type,
@@ -56,11 +113,10 @@ int msg_create(
         uint64_t payload_length,
         void *payload)
 {
-    msg_header_t *header;
     char *payload_p;
 
     // Allocate memory for message buffer
-    *message = malloc(sizeof(msg_header_t) + payload_length);
+    *message = malloc(MSG_HEADER_SIZE + payload_length);
     if (*message == NULL)
     {
         error_printf("Failed to allocate memory for messaage\n");
@@ -68,18 +124,13 @@ int msg_create(
     }
 
     // Create message header
-    header = *message;
-    header->prologue = MSG_HEADER_PROLOGUE;
-    header->type = type;
-    header->control_code = control_code;
-    header->parameter = parameter;
-    header->payload_length = payload_length;
+    msg_header_encode(*message, type, control_code, parameter, payload_length);
 
     // Copy payload if any
     if (payload_length > 0)
     {
         payload_p = *message;
-        memcpy(payload_p + sizeof(msg_header_t), payload, payload_length);
+        memcpy(payload_p + MSG_HEADER_SIZE, payload, payload_length);
     }
 
     return 0;
@@ -38,6 +38,12 @@
 
 #define MSG_HEADER_SIZE 16
 #define MSG_HEADER_PROLOGUE 0x4853 // "HS"
+#define MSG_ID_INITIAL 0xffffff00
+#define MSG_ID_UNKNOWN 0xffffffff
+
+// Status byte bits (IEEE 488.2)
+#define STB_MAV 0x10 // Message available
+#define STB_RQS 0x40 // Request service
 
 // Control codes
 #define CC_PREFER_OVERLAP     1
@@ -121,6 +127,13 @@ typedef enum
 } error_code_t;
 
 int msg_header_verify(msg_header_t *header);
+void msg_header_encode(
+        void *buffer,
+        msg_type_t type,
+        uint8_t control_code,
+        uint32_t parameter,
+        uint64_t payload_length);
+void msg_header_decode(msg_header_t *header, void *buffer);
 int msg_create(
         void **message,
         msg_type_t type,
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2017  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "pool.h"
+#include "error.h"
+
+static int pool_class(size_t size)
+{
+    size_t class_size = POOL_CLASS_SIZE_MIN;
+    int class = 0;
+
+    while (class_size + POOL_BUFFER_TAIL < size)
+    {
+        class_size <<= 1;
+        class++;
+    }
+
+    return class;
+}
+
+/*
+ * pool_init() - Initialize pool
+ *
+ * Up to cache_max returned buffers are kept per size class. Sized to the
+ * number of buffers of a class the owner has in flight at once, leasing
+ * does not touch the heap once the pool is warm. Spare buffers take up at
+ * most cache_size_max bytes, buffers returned beyond that are freed.
+ *
+ */
+
+int pool_init(pool_t *pool, int cache_max, size_t cache_size_max)
+{
+    int i;
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pool->cache_max = (cache_max > 0) ? cache_max : 1;
+    pool->cache_size = 0;
+    pool->cache_size_max = cache_size_max;
+
+    for (i=0; i<POOL_CLASSES; i++)
+    {
+        pool->cache[i] = NULL;
+        pool->cached[i] = 0;
+    }
+
+    pool->allocated = 0;
+    pool->allocated_max = 0;
+    pool->leased = 0;
+    pool->leased_max = 0;
+
+    return 0;
+}
+
+void pool_destroy(pool_t *pool)
+{
+    pool_buffer_t *buffer;
+    int i;
+
+    // Free cached buffers (all leases must have been returned)
+    for (i=0; i<POOL_CLASSES; i++)
+    {
+        while ((buffer = pool->cache[i]) != NULL)
+        {
+            pool->cache[i] = buffer->next;
+            free(buffer);
+        }
+    }
+
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+/*
+ * pool_get() - Lease buffer from pool
+ *
+ * Returns a buffer of at least size bytes. Buffers are grouped in power of
+ * two size classes and returned buffers are cached for reuse, so a steady
+ * stream of similar sized messages does not touch the heap. Buffers larger
+ * than the largest class are allocated exactly and never cached.
+ *
+ */
+
+static void pool_lease(pool_t *pool, pool_buffer_t *buffer)
+{
+    pool->leased += buffer->size;
+    if (pool->leased > pool->leased_max)
+        pool->leased_max = pool->leased;
+}
+
+pool_buffer_t *pool_get(pool_t *pool, size_t size)
+{
+    pool_buffer_t *buffer;
+    size_t buffer_size;
+    int class = pool_class(size);
+
+    pthread_mutex_lock(&pool->mutex);
+
+    // Reuse cached buffer of same class
+    if ((class < POOL_CLASSES) && (pool->cache[class] != NULL))
+    {
+        buffer = pool->cache[class];
+        pool->cache[class] = buffer->next;
+        pool->cached[class]--;
+        pool->cache_size -= buffer->size;
+        pool_lease(pool, buffer);
+        pthread_mutex_unlock(&pool->mutex);
+
+        buffer->next = NULL;
+        return buffer;
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    // Allocate new buffer
+    buffer_size = (class < POOL_CLASSES) ? ((size_t) POOL_CLASS_SIZE_MIN << class) + POOL_BUFFER_TAIL : size;
+    buffer = malloc(sizeof(pool_buffer_t) + buffer_size);
+    if (buffer == NULL)
+    {
+        error_printf("malloc() failed\n");
+        return NULL;
+    }
+
+    buffer->pool = pool;
+    buffer->next = NULL;
+    buffer->size = buffer_size;
+    buffer->class = class;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->allocated += buffer_size;
+    if (pool->allocated > pool->allocated_max)
+        pool->allocated_max = pool->allocated;
+    pool_lease(pool, buffer);
+    pthread_mutex_unlock(&pool->mutex);
+
+    return buffer;
+}
+
+void pool_put(pool_buffer_t *buffer)
+{
+    pool_t *pool;
+    int class;
+
+    if (buffer == NULL)
+        return;
+
+    pool = buffer->pool;
+    class = buffer->class;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    pool->leased -= buffer->size;
+
+    // Cache buffer for reuse unless class already has enough spare buffers
+    // or pool holds as much spare memory as allowed
+    if ((class < POOL_CLASSES) && (pool->cached[class] < pool->cache_max) &&
+        (pool->cache_size + buffer->size <= pool->cache_size_max))
+    {
+        buffer->next = pool->cache[class];
+        pool->cache[class] = buffer;
+        pool->cached[class]++;
+        pool->cache_size += buffer->size;
+        buffer = NULL;
+    }
+    else
+        pool->allocated -= buffer->size;
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    free(buffer);
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2017  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define POOL_CLASS_SIZE_MIN 256
+#define POOL_CLASSES 17 // 256 B to 16 MB
+#define POOL_BUFFER_TAIL 16 // Spare bytes past class size, so a terminator
+                            // does not move a buffer up a class
+
+typedef struct pool_buffer_t
+{
+    struct pool_t *pool;
+    struct pool_buffer_t *next;
+    size_t size;
+    int class;
+    char data[] __attribute__((aligned(16)));
+} pool_buffer_t;
+
+typedef struct pool_t
+{
+    pthread_mutex_t mutex;
+    pool_buffer_t *cache[POOL_CLASSES];
+    int cached[POOL_CLASSES];
+
+    // Spare buffers kept per class and in total (bytes)
+    int cache_max;
+    size_t cache_size;
+    size_t cache_size_max;
+
+    // Statistics (bytes)
+    size_t allocated;
+    size_t allocated_max;
+    size_t leased;
+    size_t leased_max;
+} pool_t;
+
+int pool_init(pool_t *pool, int cache_max, size_t cache_size_max);
+void pool_destroy(pool_t *pool);
+pool_buffer_t *pool_get(pool_t *pool, size_t size);
+void pool_put(pool_buffer_t *buffer);
+
+static inline pool_buffer_t *pool_buffer(void *data)
+{
+    return (pool_buffer_t *) ((char *) data - offsetof(pool_buffer_t, data));
+}
+
+#endif
@@ -0,0 +1,516 @@
+/*
+ * Copyright (c) 2017  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include "reactor.h"
+#include "tcp.h"
+#include "error.h"
+
+#define REACTOR_EVENTS_MAX 64
+
+typedef struct reactor_handle_t
+{
+    reactor_source_t source;
+    reactor_loop_t *loop;
+    int socket;
+    void *context;
+    struct reactor_handle_t *next; // Resumed handles
+} reactor_handle_t;
+
+struct reactor_loop_t
+{
+    int epoll_fd;
+    int listen_socket;
+    reactor_callbacks_t *callbacks;
+    void *data;
+
+    // Paused connections to resume, signalled through wake_fd
+    pthread_mutex_t mutex;
+    reactor_handle_t *resumed;
+    int wake_fd;
+};
+
+static void reactor_resume_handle(reactor_source_t *source)
+{
+    reactor_handle_t *handle = (reactor_handle_t *) source;
+    reactor_loop_t *loop = handle->loop;
+    uint64_t value = 1;
+
+    pthread_mutex_lock(&loop->mutex);
+    handle->next = loop->resumed;
+    loop->resumed = handle;
+    pthread_mutex_unlock(&loop->mutex);
+
+    if (write(loop->wake_fd, &value, sizeof(value)) < 0)
+        error_printf("write() call failed (%s)\n", strerror(errno));
+}
+
+static reactor_handle_t *reactor_handle_new(reactor_loop_t *loop, int socket)
+{
+    reactor_handle_t *handle;
+
+    handle = malloc(sizeof(reactor_handle_t));
+    if (handle == NULL)
+    {
+        error_printf("malloc() failed\n");
+        return NULL;
+    }
+
+    handle->source.resume = reactor_resume_handle;
+    handle->loop = loop;
+    handle->socket = socket;
+    handle->context = NULL;
+    handle->next = NULL;
+
+    return handle;
+}
+
+static int reactor_watch(reactor_loop_t *loop, reactor_handle_t *handle)
+{
+    struct epoll_event event;
+
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.ptr = handle;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, handle->socket, &event) < 0)
+    {
+        error_printf("epoll_ctl() call failed (%s)\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int reactor_wake_init(reactor_loop_t *loop)
+{
+    struct epoll_event event;
+
+    pthread_mutex_init(&loop->mutex, NULL);
+    loop->resumed = NULL;
+
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wake_fd < 0)
+    {
+        error_printf("eventfd() call failed (%s)\n", strerror(errno));
+        return -1;
+    }
+
+    // Wake fd is registered with loop itself as data
+    event.events = EPOLLIN;
+    event.data.ptr = loop;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &event) < 0)
+    {
+        error_printf("epoll_ctl() call failed (%s)\n", strerror(errno));
+        close(loop->wake_fd);
+        loop->wake_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void reactor_accept(reactor_loop_t *loop)
+{
+    reactor_handle_t *handle;
+    int client_socket;
+    int enable = 1;
+
+    // Accept one connection per wakeup so connections spread across loops
+    client_socket = accept4(loop->listen_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_socket < 0)
+    {
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+            error_printf("accept4() call failed (%s)\n", strerror(errno));
+        return;
+    }
+
+    setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    handle = reactor_handle_new(loop, client_socket);
+    if (handle == NULL)
+    {
+        close(client_socket);
+        return;
+    }
+
+    // Create connection context
+    handle->context = loop->callbacks->open(client_socket, loop->data, &handle->source);
+    if (handle->context == NULL)
+    {
+        close(client_socket);
+        free(handle);
+        return;
+    }
+
+    // Watch connection on this event loop only
+    if (reactor_watch(loop, handle) < 0)
+    {
+        loop->callbacks->close(handle->context);
+        free(handle);
+    }
+}
+
+static void reactor_input(reactor_loop_t *loop, reactor_handle_t *handle, bool watched)
+{
+    void *context;
+    int status;
+
+    // Let connection consume available input (also detects hangup)
+    status = loop->callbacks->input(handle->context);
+    if (status < 0)
+    {
+        if (watched)
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, handle->socket, NULL);
+        loop->callbacks->close(handle->context);
+        free(handle);
+    }
+    else if (status == REACTOR_DETACH)
+    {
+        // Connection continues elsewhere
+        if (watched)
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, handle->socket, NULL);
+        context = handle->context;
+        free(handle);
+        loop->callbacks->detach(context);
+    }
+    else if (status == REACTOR_PAUSE)
+    {
+        // Unwatched until connection resumes itself
+        if (watched)
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, handle->socket, NULL);
+    }
+    else if (!watched)
+    {
+        if (reactor_watch(loop, handle) < 0)
+        {
+            loop->callbacks->close(handle->context);
+            free(handle);
+        }
+    }
+}
+
+static void reactor_wake(reactor_loop_t *loop)
+{
+    reactor_handle_t *handle, *next;
+    uint64_t value;
+
+    if (read(loop->wake_fd, &value, sizeof(value)) < 0)
+        return;
+
+    pthread_mutex_lock(&loop->mutex);
+    handle = loop->resumed;
+    loop->resumed = NULL;
+    pthread_mutex_unlock(&loop->mutex);
+
+    // Resumed connections first process input held back while paused
+    for (; handle != NULL; handle = next)
+    {
+        next = handle->next;
+        reactor_input(loop, handle, false);
+    }
+}
+
+static void *reactor_loop(void *arg)
+{
+    reactor_loop_t *loop = arg;
+    struct epoll_event events[REACTOR_EVENTS_MAX];
+    reactor_handle_t *handle;
+    int i, n;
+
+    while (1)
+    {
+        n = epoll_wait(loop->epoll_fd, events, REACTOR_EVENTS_MAX, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            error_printf("epoll_wait() call failed (%s)\n", strerror(errno));
+            break;
+        }
+
+        for (i=0; i<n; i++)
+        {
+            handle = events[i].data.ptr;
+
+            // Listening socket is registered with NULL handle
+            if (handle == NULL)
+            {
+                reactor_accept(loop);
+                continue;
+            }
+
+            if (events[i].data.ptr == loop)
+            {
+                reactor_wake(loop);
+                continue;
+            }
+
+            reactor_input(loop, handle, true);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * reactor_create() - Create event loop without listening socket
+ *
+ * Starts an event loop thread serving connections handed to it with
+ * reactor_add(), e.g. connections detached from another event loop.
+ *
+ */
+
+reactor_loop_t *reactor_create(reactor_callbacks_t *callbacks)
+{
+    reactor_loop_t *loop;
+    pthread_t thread;
+
+    loop = calloc(1, sizeof(reactor_loop_t));
+    if (loop == NULL)
+    {
+        error_printf("calloc() failed\n");
+        return NULL;
+    }
+
+    loop->listen_socket = -1;
+    loop->callbacks = callbacks;
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0)
+    {
+        error_printf("epoll_create1() call failed (%s)\n", strerror(errno));
+        free(loop);
+        return NULL;
+    }
+
+    if (reactor_wake_init(loop) < 0)
+    {
+        close(loop->epoll_fd);
+        free(loop);
+        return NULL;
+    }
+
+    if (pthread_create(&thread, NULL, reactor_loop, loop) != 0)
+    {
+        error_printf("pthread_create() failed\n");
+        close(loop->wake_fd);
+        close(loop->epoll_fd);
+        free(loop);
+        return NULL;
+    }
+    pthread_detach(thread);
+
+    return loop;
+}
+
+int reactor_add(reactor_loop_t *loop, int socket, void *context)
+{
+    reactor_handle_t *handle;
+
+    handle = reactor_handle_new(loop, socket);
+    if (handle == NULL)
+        return -1;
+
+    handle->context = context;
+
+    if (reactor_watch(loop, handle) < 0)
+    {
+        free(handle);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int reactor_loop_init(reactor_loop_t *loop, int listen_socket, reactor_callbacks_t *callbacks, void *data)
+{
+    struct epoll_event event;
+
+    loop->listen_socket = listen_socket;
+    loop->callbacks = callbacks;
+    loop->data = data;
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0)
+    {
+        error_printf("epoll_create1() call failed (%s)\n", strerror(errno));
+        return -1;
+    }
+
+    // Wake only one loop per incoming connection
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = NULL;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, listen_socket, &event) < 0)
+    {
+        error_printf("epoll_ctl() call failed (%s)\n", strerror(errno));
+        goto error_epoll;
+    }
+
+    if (reactor_wake_init(loop) < 0)
+        goto error_epoll;
+
+    return 0;
+
+error_epoll:
+    close(loop->epoll_fd);
+    loop->epoll_fd = -1;
+    return -1;
+}
+
+/*
+ * reactor_run() - Run event loop on shared listening socket
+ *
+ * Runs an event loop in the calling thread accepting connections from a
+ * non-blocking listening socket other event loops serve too, e.g. in place
+ * of an io_uring event loop that could not be set up. Does not return
+ * unless an error occurs.
+ *
+ */
+
+int reactor_run(int listen_socket, reactor_callbacks_t *callbacks, void *data)
+{
+    reactor_loop_t *loop;
+
+    loop = calloc(1, sizeof(reactor_loop_t));
+    if (loop == NULL)
+    {
+        error_printf("calloc() failed\n");
+        return -1;
+    }
+
+    if (reactor_loop_init(loop, listen_socket, callbacks, data) < 0)
+    {
+        free(loop);
+        return -1;
+    }
+
+    reactor_loop(loop);
+
+    return -1;
+}
+
+/*
+ * reactor_start() - Start event driven TCP server
+ *
+ * This will start a TCP server that multiplexes all connections on a number
+ * of epoll event loop threads. Each loop accepts connections from the shared
+ * listening socket and owns the connections it accepted, so connection
+ * callbacks are never called concurrently for the same connection.
+ *
+ * Listen flags are passed to tcp_listen(), with TCP_LISTEN_REUSEPORT several
+ * reactors (shards) can serve the same port, each with its own listening
+ * socket.
+ *
+ * The calling thread runs the first event loop, so this does not return
+ * unless an error occurs.
+ *
+ */
+
+int reactor_start(int port, int n, int listen_flags, int threads, reactor_callbacks_t *callbacks, void *data)
+{
+    reactor_loop_t *loops;
+    pthread_t thread;
+    int listen_socket;
+    int i;
+
+    if (threads < 1)
+        threads = 1;
+
+    // Create non-blocking listening socket
+    if ((listen_socket = tcp_listen(port, n, listen_flags)) < 0)
+        return -1;
+
+    if (fcntl(listen_socket, F_SETFL, fcntl(listen_socket, F_GETFL) | O_NONBLOCK) < 0)
+    {
+        error_printf("fcntl() call failed (%s)\n", strerror(errno));
+        goto error_listen;
+    }
+
+    loops = calloc(threads, sizeof(reactor_loop_t));
+    if (loops == NULL)
+    {
+        error_printf("calloc() failed\n");
+        goto error_listen;
+    }
+
+    for (i=0; i<threads; i++)
+    {
+        if (reactor_loop_init(&loops[i], listen_socket, callbacks, data) < 0)
+            goto error_loops;
+    }
+
+    // Start additional event loop threads
+    for (i=1; i<threads; i++)
+    {
+        if (pthread_create(&thread, NULL, reactor_loop, &loops[i]) != 0)
+        {
+            // Loops without a thread still share the listening socket
+            // through their own epoll instance, so just run fewer loops
+            error_printf("pthread_create() failed\n");
+            epoll_ctl(loops[i].epoll_fd, EPOLL_CTL_DEL, listen_socket, NULL);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    printf("Running %d event loop thread(s)\n", threads);
+
+    // Run first event loop in calling thread
+    reactor_loop(&loops[0]);
+
+    return -1;
+
+error_loops:
+    for (i=0; i<threads; i++)
+    {
+        if (loops[i].wake_fd > 0)
+            close(loops[i].wake_fd);
+        if (loops[i].epoll_fd > 0)
+            close(loops[i].epoll_fd);
+    }
+    free(loops);
+error_listen:
+    close(listen_socket);
+    return -1;
+}
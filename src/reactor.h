@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2017  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdbool.h>
+
+#define REACTOR_DETACH 1 // Input callback result handing socket over
+#define REACTOR_PAUSE  2 // Input callback result pausing reads from socket
+
+typedef struct reactor_loop_t reactor_loop_t;
+
+// Event loop end of a connection, lets any thread resume a paused connection
+typedef struct reactor_source_t
+{
+    void (*resume)(struct reactor_source_t *source);
+} reactor_source_t;
+
+typedef struct
+{
+    // Called for each accepted connection, returns connection context
+    void *(*open)(int socket, void *data, reactor_source_t *source);
+
+    // Called when connection socket is readable, returns -1 to close,
+    // REACTOR_DETACH to stop watching socket without closing it or
+    // REACTOR_PAUSE to stop reading until reactor_resume(), which calls it
+    // again even if no new data arrived
+    int (*input)(void *context);
+
+    // Called when connection is closed
+    void (*close)(void *context);
+
+    // Called once event loop no longer touches detached connection
+    void (*detach)(void *context);
+
+} reactor_callbacks_t;
+
+int reactor_start(int port, int n, int listen_flags, int threads, reactor_callbacks_t *callbacks, void *data);
+int reactor_run(int listen_socket, reactor_callbacks_t *callbacks, void *data);
+reactor_loop_t *reactor_create(reactor_callbacks_t *callbacks);
+int reactor_add(reactor_loop_t *loop, int socket, void *context);
+
+static inline void reactor_resume(reactor_source_t *source)
+{
+    source->resume(source);
+}
+
+#endif
@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2017  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ring.h"
+#include "error.h"
+
+int ring_init(ring_t *ring, size_t size)
+{
+    ring->data = malloc(size);
+    if (ring->data == NULL)
+    {
+        error_printf("malloc() failed\n");
+        return -1;
+    }
+
+    ring->size = size;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->used = 0;
+
+    return 0;
+}
+
+void ring_destroy(ring_t *ring)
+{
+    free(ring->data);
+    ring->data = NULL;
+}
+
+/*
+ * ring_write_pointer() - Get contiguous free space
+ *
+ * Returns pointer to the largest contiguous free space at the write position
+ * so data can be received directly into the ring. Once data has been written
+ * it must be committed with ring_write_commit().
+ *
+ */
+
+void *ring_write_pointer(ring_t *ring, size_t *length)
+{
+    // Rewind empty ring to make all space contiguous
+    if (ring->used == 0)
+    {
+        ring->head = 0;
+        ring->tail = 0;
+    }
+
+    if (ring->tail >= ring->head && ring->used < ring->size)
+        *length = ring->size - ring->tail;
+    else
+        *length = ring->head - ring->tail;
+
+    return ring->data + ring->tail;
+}
+
+void ring_write_commit(ring_t *ring, size_t length)
+{
+    ring->tail = (ring->tail + length) % ring->size;
+    ring->used += length;
+}
+
+static size_t ring_consume(ring_t *ring, void *buffer, size_t length)
+{
+    size_t chunk;
+
+    if (length > ring->used)
+        length = ring->used;
+
+    // Copy out in up to two chunks when data wraps around end of ring
+    chunk = ring->size - ring->head;
+    if (chunk > length)
+        chunk = length;
+
+    if (buffer != NULL)
+    {
+        memcpy(buffer, ring->data + ring->head, chunk);
+        memcpy((char *) buffer + chunk, ring->data, length - chunk);
+    }
+
+    ring->head = (ring->head + length) % ring->size;
+    ring->used -= length;
+
+    return length;
+}
+
+size_t ring_read(ring_t *ring, void *buffer, size_t length)
+{
+    return ring_consume(ring, buffer, length);
+}
+
+size_t ring_skip(ring_t *ring, size_t length)
+{
+    return ring_consume(ring, NULL, length);
+}
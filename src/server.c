@@ -36,197 +36,1855 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <pthread.h>
+#include <endian.h>
+#include <time.h>
 #include <hislip/server.h>
 #include <hislip/common.h>
 #include "tcp.h"
 #include "message.h"
 #include "error.h"
 #include "session.h"
+#include "reactor.h"
+#include "uring.h"
+#include "worker.h"
+#include "ring.h"
+#include "pool.h"
+#include "stats.h"
+#include "lock.h"
+#include "trace.h"
 
 #define SERVER_PROTOCOL_VERSION 0x100 // Major = 1, Minor = 0
+#define SERVER_IOV_MAX 16
+#define SERVER_RECEIVE_BUFFER_SIZE 0x10000 // 64 KB
+#define SERVER_READ_MAX 0x40000000
+#define SERVER_POOL_CACHE_SIZE 0x100000 // 1 MB of spare buffers per connection
 
-typedef LIST_HEAD(subaddress_head_t, hs_subaddress_data_t) subaddress_head_t;
-subaddress_head_t *subaddress_head;
+// Part of server owning a listener, event loop threads, worker pool and
+// session table so shards do not share locks
+struct hs_server_shard_t
+{
+    hs_server_t *server;
+    int number;
+    session_table_t sessions;
+    worker_pool_t worker_pool;
+
+    // Event loop serving asynchronous channels, so control messages are
+    // never stuck behind synchronous channel traffic
+    reactor_loop_t *async_loop;
+};
+
+typedef enum
+{
+    RECEIVE_HEADER,
+    RECEIVE_PAYLOAD,
+    RECEIVE_DISCARD
+} receive_state_t;
+
+typedef struct
+{
+    int socket;
+    hs_server_t *server;
+    hs_server_shard_t *shard;
+
+    // Session in table of shard that accepted synchronous channel
+    session_table_t *sessions;
+    int session;
+    uint16_t session_id;
+    bool async;
+    bool detach; // Move to asynchronous channel event loop
+    int refs;
+    bool closed;
+    pthread_mutex_t write_mutex;
+
+    // Statistics slot of linked subaddress
+    int stats_slot;
+
+    // Locking by asynchronous channel
+    hs_lock_t *lock;
+    lock_owner_t lock_owner;
+
+    // Resumable receive state
+    ring_t ring;
+    receive_state_t state;
+    msg_header_t msg_header;
+    uint64_t received;
+    uint64_t discard;
+    bool streaming;
+
+    // Payload buffer being filled (whole payload or streamed chunk)
+    pool_buffer_t *payload;
+    uint64_t chunk_size;
+    uint64_t chunk_length;
+
+    // Message assembled from Data/DataEnd payloads
+    pool_buffer_t *message;
+    uint64_t message_length;
+    bool stream_active;
+
+    // Payload and request buffers
+    pool_t pool;
+
+    // Requests are executed in order on the worker pool
+    worker_queue_t queue;
+
+    // Event loop input paused until worker pool has space (NULL source
+    // when served by a thread of its own)
+    reactor_source_t *source;
+    worker_waiter_t waiter;
+    bool paused;
+} connection_t;
+
+struct hs_request_t
+{
+    worker_job_t job;
+    connection_t *connection;
+    int refs;
+    uint32_t message_id;
+    uint32_t generation; // Device clear generation request belongs to
+    uint8_t type;
+    pool_buffer_t *message;
+    int length;
+    int flags;
+};
+
+static inline session_t *connection_session(connection_t *connection)
+{
+    return &connection->sessions->entry[connection->session];
+}
+
+// Callbacks of subaddress connection is linked to, NULL if none
+static inline hs_subaddress_callbacks_t *connection_callbacks(connection_t *connection)
+{
+    hs_subaddress_data_t *sd;
+
+    if (connection->session < 0)
+        return NULL;
+
+    sd = connection_session(connection)->subaddress_data;
+
+    return (sd != NULL) ? sd->callbacks : NULL;
+}
+
+static inline bool connection_clearing(connection_t *connection)
+{
+    return (connection->session >= 0) && !connection->async &&
+        __atomic_load_n(&connection_session(connection)->clearing, __ATOMIC_ACQUIRE);
+}
+
+static inline bool request_cancelled(hs_request_t *request)
+{
+    return request->generation !=
+        __atomic_load_n(&connection_session(request->connection)->clear_generation, __ATOMIC_ACQUIRE);
+}
+
+static void connection_get(connection_t *connection)
+{
+    __atomic_add_fetch(&connection->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void connection_put(connection_t *connection)
+{
+    hs_server_t *server = connection->server;
+    connection_t *channel;
+
+    if (__atomic_sub_fetch(&connection->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    // Last reference gone, no request can use session or socket anymore
+    if (connection->session >= 0)
+    {
+        pthread_mutex_lock(&connection->sessions->channel_mutex);
+
+        if (connection->async)
+        {
+            // Session outlived synchronous channel for us, free it now
+            session_table_free(connection->sessions, connection->session);
+            channel = NULL;
+        }
+        else
+        {
+            // Stop further asynchronous channels from linking to session
+            channel = __atomic_exchange_n(&connection_session(connection)->channel_async, NULL, __ATOMIC_ACQ_REL);
+            connection_session(connection)->channel_closed = true;
+            if (channel == NULL)
+                session_table_free(connection->sessions, connection->session);
+        }
+
+        pthread_mutex_unlock(&connection->sessions->channel_mutex);
+
+        if (channel != NULL)
+        {
+            // Asynchronous channel may still be using session, so it frees
+            // the session once it has been shut down and is gone
+            shutdown(channel->socket, SHUT_RDWR);
+            connection_put(channel);
+        }
+    }
+
+    server->tcp_close(connection->socket);
+    stats_add(&stats_thread(server->stats)->connections_closed, 1);
+
+    stats_max(&stats_thread(server->stats)->pool_allocated_max, connection->pool.allocated_max);
+    stats_max(&stats_thread(server->stats)->pool_leased_max, connection->pool.leased_max);
+
+    pthread_mutex_destroy(&connection->write_mutex);
+    ring_destroy(&connection->ring);
+    pool_destroy(&connection->pool);
+    free(connection);
+}
+
+/*
+ * server_write() - Write message to connection
+ *
+ * Sends header and payload buffers with a single vectored write so payloads
+ * are never copied into a message buffer. Trace records the message as
+ * response to request trace_id. Caller must hold write mutex.
+ *
+ */
+
+static int server_write(
+        connection_t *connection,
+        msg_type_t type,
+        uint8_t control_code,
+        uint32_t parameter,
+        const struct iovec *iov,
+        int iovcnt,
+        uint32_t trace_id)
+{
+    hs_server_t *server = connection->server;
+    struct iovec vector[SERVER_IOV_MAX];
+    struct iovec *v = vector;
+    uint8_t header[MSG_HEADER_SIZE];
+    uint64_t payload_length = 0;
+    int status, i;
+
+    // Large vectors need heap allocated space for header entry
+    if (iovcnt + 1 > SERVER_IOV_MAX)
+    {
+        v = malloc((iovcnt + 1) * sizeof(struct iovec));
+        if (v == NULL)
+        {
+            error_printf("malloc() failed\n");
+            return -1;
+        }
+    }
+
+    for (i=0; i<iovcnt; i++)
+    {
+        v[i + 1] = iov[i];
+        payload_length += iov[i].iov_len;
+    }
+
+    msg_header_encode(header, type, control_code, parameter, payload_length);
+    v[0].iov_base = header;
+    v[0].iov_len = MSG_HEADER_SIZE;
+
+    status = server->tcp_writev(connection->socket, v, iovcnt + 1, server->config->message_timeout);
+
+    if (v != vector)
+        free(v);
+
+    if (status >= 0)
+    {
+        stats_message_out(server->stats, connection->stats_slot, type, payload_length);
+        trace_event(HS_TRACE_RESPONSE, connection->session_id, trace_id, type);
+    }
+
+    return (status < 0) ? -1 : 0;
+}
+
+static int server_send(
+        connection_t *connection,
+        msg_type_t type,
+        uint8_t control_code,
+        uint32_t parameter,
+        const struct iovec *iov,
+        int iovcnt)
+{
+    int status;
+
+    pthread_mutex_lock(&connection->write_mutex);
+    status = server_write(connection, type, control_code, parameter, iov, iovcnt, parameter);
+    pthread_mutex_unlock(&connection->write_mutex);
+
+    return status;
+}
+
+static int server_send_error(connection_t *connection, error_code_t code, char *message)
+{
+    struct iovec iov;
+
+    iov.iov_base = message;
+    iov.iov_len = strlen(message);
+
+    return server_send(connection, Error, code, 0, &iov, 1);
+}
+
+/*
+ * server_send_data() - Send data message on synchronous channel
+ *
+ * Sends payload buffers as a DataEnd message, or as a sequence of Data
+ * messages terminated by DataEnd if the payload exceeds the maximum message
+ * size the client accepts. Fragments of one response are never interleaved
+ * with other messages.
+ *
+ * In synchronized mode each message carries the MessageID of the request
+ * answered. In overlapped mode the server numbers its messages itself.
+ *
+ * Responses to requests cancelled by device clear are dropped, a response
+ * already being sent is completed.
+ *
+ */
+
+static int server_send_data(hs_request_t *request, const struct iovec *iov, int iovcnt)
+{
+    connection_t *connection = request->connection;
+    session_t *s = connection_session(connection);
+    uint32_t message_id = request->message_id;
+    struct iovec vector[SERVER_IOV_MAX];
+    struct iovec *v = vector;
+    uint64_t max_message_size, fragment_size_max, fragment_size, remaining = 0;
+    size_t offset = 0;
+    int i, n, status = 0;
+
+    for (i=0; i<iovcnt; i++)
+        remaining += iov[i].iov_len;
+
+    max_message_size = __atomic_load_n(&s->max_message_size_send, __ATOMIC_RELAXED);
+    fragment_size_max = (max_message_size > MSG_HEADER_SIZE) ? max_message_size - MSG_HEADER_SIZE : 1;
+
+    // A fragment never spans more buffers than the payload
+    if (iovcnt > SERVER_IOV_MAX)
+    {
+        v = malloc(iovcnt * sizeof(struct iovec));
+        if (v == NULL)
+        {
+            error_printf("malloc() failed\n");
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&connection->write_mutex);
+
+    // Checked under write mutex so nothing stale follows DeviceClearAcknowledge
+    if (request_cancelled(request))
+    {
+        errno = ECANCELED;
+        status = -1;
+        goto out;
+    }
+
+    // Synchronized mode MAV is set by first message of response
+    if (!s->overlap)
+        __atomic_store_n(&s->mav, true, __ATOMIC_RELAXED);
+
+    i = 0;
+    do
+    {
+        fragment_size = (remaining > fragment_size_max) ? fragment_size_max : remaining;
+        remaining -= fragment_size;
+
+        // Collect buffer slices making up next fragment
+        for (n=0; fragment_size > 0; n++)
+        {
+            size_t length = iov[i].iov_len - offset;
+
+            if (length > fragment_size)
+                length = fragment_size;
+
+            v[n].iov_base = (char *) iov[i].iov_base + offset;
+            v[n].iov_len = length;
+            fragment_size -= length;
+            offset += length;
+
+            if (offset == iov[i].iov_len)
+            {
+                offset = 0;
+                i++;
+            }
+        }
+
+        if (s->overlap)
+        {
+            message_id = s->message_id;
+            __atomic_store_n(&s->message_id, message_id + 2, __ATOMIC_RELAXED);
+        }
+
+        // Overlapped mode MessageID is ours, trace tells request answered
+        status = server_write(connection, (remaining > 0) ? Data : DataEnd, 0, message_id, v, n,
+                request->message_id);
+    }
+    while ((remaining > 0) && (status == 0));
+
+out:
+    pthread_mutex_unlock(&connection->write_mutex);
+
+    if (v != vector)
+        free(v);
+
+    return status;
+}
+
+static void request_put(hs_request_t *request)
+{
+    connection_t *connection = request->connection;
+
+    if (__atomic_sub_fetch(&request->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    // Return message and request buffers to connection pool
+    pool_put(request->message);
+    pool_put(pool_buffer(request));
+
+    connection_put(connection);
+}
+
+static uint64_t server_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void request_execute(worker_job_t *job)
+{
+    hs_request_t *request = (hs_request_t *) job;
+    connection_t *connection = request->connection;
+    hs_subaddress_callbacks_t *callbacks = connection_callbacks(connection);
+    uint64_t start;
+
+    // Worker still updates connection queue once request is done, reference
+    // is returned by request_done()
+    connection_get(connection);
+
+    // Skip requests of connections closed or cleared while queued
+    if ((callbacks != NULL) && (__atomic_load_n(&connection->closed, __ATOMIC_ACQUIRE) == false) &&
+        !request_cancelled(request))
+    {
+        trace_event(HS_TRACE_CALLBACK_START, connection->session_id, request->message_id, request->type);
+        start = server_time();
+
+        if (callbacks->message_stream != NULL)
+            callbacks->message_stream(request, request->message->data, request->length, request->flags);
+        else if (callbacks->message_sync != NULL)
+            callbacks->message_sync(request, request->message->data, request->length);
+
+        stats_callback_time(connection->server->stats, connection->stats_slot, server_time() - start);
+        trace_event(HS_TRACE_CALLBACK_END, connection->session_id, request->message_id, request->type);
+    }
+
+    // Request stays alive if callback retained it
+    request_put(request);
+}
+
+static void request_done(worker_queue_t *queue)
+{
+    connection_put((connection_t *) ((char *) queue - offsetof(connection_t, queue)));
+}
+
+static int message_append(connection_t *connection)
+{
+    msg_header_t *msg_header = &connection->msg_header;
+    pool_buffer_t *message;
+    uint64_t length;
+
+    if (msg_header->payload_length == 0)
+        return 0;
+
+    // Take over payload buffer if it starts a new message
+    if (connection->message == NULL)
+    {
+        connection->message = connection->payload;
+        connection->message_length = msg_header->payload_length;
+        connection->payload = NULL;
+        return 0;
+    }
+
+    length = connection->message_length + msg_header->payload_length;
+    if (length > connection->server->config->payload_size_max)
+    {
+        error_printf("Maximum message size exceeded\n");
+        return -1;
+    }
+
+    // Move message to buffer of next size class if payload does not fit
+    if (length + 1 > connection->message->size)
+    {
+        message = pool_get(&connection->pool, length + 1);
+        if (message == NULL)
+            return -1;
+        memcpy(message->data, connection->message->data, connection->message_length);
+        pool_put(connection->message);
+        connection->message = message;
+    }
+
+    // Append payload (zero terminated for string messages)
+    memcpy(connection->message->data + connection->message_length,
+            connection->payload->data, msg_header->payload_length);
+    connection->message_length = length;
+    connection->message->data[length] = 0;
+
+    return 0;
+}
+
+static int request_submit(connection_t *connection, pool_buffer_t *message, uint64_t length, int flags)
+{
+    pool_buffer_t *buffer;
+    hs_request_t *request;
+
+    buffer = pool_get(&connection->pool, sizeof(hs_request_t));
+    if (buffer == NULL)
+    {
+        pool_put(message);
+        return -1;
+    }
+
+    // Empty message (DataEnd without any payload)
+    if (message == NULL)
+    {
+        message = pool_get(&connection->pool, 1);
+        if (message == NULL)
+        {
+            pool_put(buffer);
+            return -1;
+        }
+        message->data[0] = 0;
+    }
+
+    // Request owns message buffer
+    request = (hs_request_t *) buffer->data;
+    request->job.function = request_execute;
+    request->connection = connection;
+    request->refs = 1;
+    request->message_id = connection->msg_header.parameter;
+    request->generation = __atomic_load_n(&connection_session(connection)->clear_generation, __ATOMIC_ACQUIRE);
+    request->type = connection->msg_header.type;
+    request->message = message;
+    request->length = length;
+    request->flags = flags;
+
+    // Request keeps connection alive until executed
+    connection_get(connection);
+
+    // Recorded first, worker may run request before submit returns
+    trace_event(HS_TRACE_ENQUEUE, connection->session_id, request->message_id, request->type);
+
+    // Event loop pauses connection while worker queue is full, connection
+    // thread blocks
+    if (connection->source == NULL)
+        worker_submit(&connection->shard->worker_pool, &connection->queue, &request->job);
+    else if (worker_push(&connection->shard->worker_pool, &connection->queue, &request->job, &connection->waiter))
+        connection->paused = true;
+
+    return 0;
+}
+
+static int message_submit(connection_t *connection)
+{
+    pool_buffer_t *message = connection->message;
+    uint64_t length = connection->message_length;
+
+    // Hand complete message over to request
+    connection->message = NULL;
+    connection->message_length = 0;
+
+    return request_submit(connection, message, length, 0);
+}
+
+static int stream_submit(connection_t *connection)
+{
+    msg_header_t *msg_header = &connection->msg_header;
+    pool_buffer_t *chunk = connection->payload;
+    uint64_t length = connection->chunk_length;
+    int flags = 0;
+
+    // Mark message boundaries
+    if (!connection->stream_active)
+        flags |= HS_STREAM_START;
+    if ((msg_header->type == DataEnd) && (connection->received == msg_header->payload_length))
+        flags |= HS_STREAM_END;
+    connection->stream_active = !(flags & HS_STREAM_END);
+
+    // Hand chunk over to request
+    connection->payload = NULL;
+    connection->chunk_length = 0;
+
+    return request_submit(connection, chunk, length, flags);
+}
+
+static hs_subaddress_data_t *server_subaddress_lookup(hs_server_t *server, char *subaddress)
+{
+    hs_subaddress_data_t *sd;
+
+    // Lookup subaddress in list of registered subaddresses
+    LIST_FOREACH(sd, &server->subaddresses, entries)
+    {
+        if (strcmp(sd->subaddress, subaddress) == 0)
+            return sd;
+    }
+
+    return NULL;
+}
+
+static session_table_t *server_session_table(hs_server_t *server, uint16_t SessionID)
+{
+    int shard = 0;
+
+    // Upper SessionID bits tell which shard holds session
+    if (server->shard_bits > 0)
+        shard = SessionID >> (16 - server->shard_bits);
+
+    if (shard >= server->shards_count)
+        shard = 0;
+
+    return &server->shards[shard].sessions;
+}
+
+/*
+ * hs_dispatch_sync() - Dispatch message of synchronous channel
+ *
+ * Also handles the first message of every connection, which tells whether
+ * it is a synchronous (Initialize) or asynchronous (AsyncInitialize) channel.
+ *
+ */
+
+static int hs_dispatch_sync(connection_t *connection)
+{
+    hs_server_t *server = connection->server;
+    msg_header_t *msg_header = &connection->msg_header;
+    session_t *s;
+    int i, status;
+
+    // Perform action depending on message type
+    switch (msg_header->type)
+    {
+        case Initialize:
+            {
+                // Decode parameter field:
+                //  Client protocol version (upper)
+                //  Client vendor id (lower)
+                uint16_t client_protocol_version = msg_header->parameter >> 16;
+
+                // Check if HiSlip protocol version is supported
+                if (client_protocol_version != SERVER_PROTOCOL_VERSION)
+                {
+                    error_printf("Unsupported protocol version\n");
+                    return -1;
+                }
+            }
+
+            if (connection->session >= 0)
+            {
+                error_printf("Connection already initialized\n");
+                return -1;
+            }
+
+            // Create new connection session
+            connection->sessions = &connection->shard->sessions;
+            i = session_table_new(connection->sessions);
+            if (i < 0)
+            {
+                error_printf("Could not allocate new session!\n");
+                stats_add(&stats_thread(server->stats)->rejected_sessions, 1);
+                return -1;
+            }
+            s = &connection->sessions->entry[i];
+            s->socket_sync = connection->socket;
+            s->max_message_size_receive = server->config->payload_size_max + MSG_HEADER_SIZE;
+            s->overlap = server->config->overlap_mode;
+            s->message_id = MSG_ID_INITIAL;
+            connection->session = i;
+            connection->session_id = s->SessionID;
+
+            // Link connection session with registered subaddress callbacks
+            s->subaddress_data = server_subaddress_lookup(server, connection->payload ? connection->payload->data : "");
+            if (s->subaddress_data == NULL)
+            {
+                error_printf("Unable to link subaddress\n");
+                stats_add(&stats_thread(server->stats)->rejected_sessions, 1);
+                // TODO: Respond FatalError
+                return -1;
+            }
+            printf("found subaddress\n");
+            connection->stats_slot = s->subaddress_data->index;
+
+            // Send InitializeResponse message including
+            //  SessionID
+            //  Overlap-mode
+            //  Server protocol version
+            if (server_send(connection, InitializeResponse,
+                        s->overlap ? CC_PREFER_OVERLAP : CC_PREFER_SYNC,
+                        (SERVER_PROTOCOL_VERSION << 16) + s->SessionID, NULL, 0) != 0)
+                return -1;
+
+            break;
+
+        case InitializeResponse:
+            break;
+        case AsyncInitialize:
+            if (connection->session >= 0)
+            {
+                error_printf("Connection already initialized\n");
+                return -1;
+            }
+
+            // Link asynchronous channel to session of synchronous channel.
+            // Session can not be freed while link is made.
+            connection->sessions = server_session_table(server, msg_header->parameter & 0xFFFF);
+            pthread_mutex_lock(&connection->sessions->channel_mutex);
+            i = session_table_lookup(connection->sessions, msg_header->parameter & 0xFFFF);
+            if ((i < 0) || connection->sessions->entry[i].channel_closed)
+            {
+                pthread_mutex_unlock(&connection->sessions->channel_mutex);
+                error_printf("AsyncInitialize for unknown session\n");
+                // TODO: Respond FatalError
+                return -1;
+            }
+
+            // Session keeps channel for sending service requests
+            s = &connection->sessions->entry[i];
+            if (__atomic_load_n(&s->channel_async, __ATOMIC_ACQUIRE) != NULL)
+            {
+                pthread_mutex_unlock(&connection->sessions->channel_mutex);
+                error_printf("Session already has asynchronous channel\n");
+                return -1;
+            }
+            if (s->subaddress_data != NULL)
+            {
+                connection->stats_slot = s->subaddress_data->index;
+                connection->lock = s->subaddress_data->lock;
+            }
+            connection_get(connection);
+            __atomic_store_n(&s->channel_async, connection, __ATOMIC_RELEASE);
+            s->socket_async = connection->socket;
+            connection->session = i;
+            connection->session_id = s->SessionID;
+            connection->async = true;
+            pthread_mutex_unlock(&connection->sessions->channel_mutex);
+
+            // Event loop modes respond once channel is moved to its own loop
+            if (server->io_mode != HS_IO_THREADED)
+            {
+                connection->detach = true;
+                break;
+            }
+
+            // Send AsyncInitializeResponse message including server vendor id
+            if (server_send(connection, AsyncInitializeResponse, 0, HISLIP_VENDOR_ID, NULL, 0) != 0)
+                return -1;
+
+            break;
+
+        case AsyncInitializeResponse:
+            break;
+        case Data:
+        case DataEnd:
+            if ((connection->session < 0) || connection->async)
+            {
+                error_printf("Data received before Initialize\n");
+                return -1;
+            }
+
+            // Collect message until DataEnd completes it
+            if (message_append(connection) != 0)
+                return -1;
+
+            if (msg_header->type == DataEnd)
+                return message_submit(connection);
+
+            break;
+        case DeviceClearComplete:
+            if ((connection->session < 0) || connection->async)
+            {
+                error_printf("DeviceClearComplete received before Initialize\n");
+                return -1;
+            }
+            s = connection_session(connection);
+
+            // Abandon partially received message
+            pool_put(connection->message);
+            connection->message = NULL;
+            connection->message_length = 0;
+            connection->stream_active = false;
+
+            pthread_mutex_lock(&connection->write_mutex);
+
+            // Both modes are supported so client request is granted
+            __atomic_store_n(&s->overlap, (msg_header->control_code & CC_PREFER_OVERLAP) != 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&s->message_id, MSG_ID_INITIAL, __ATOMIC_RELAXED);
+            __atomic_store_n(&s->message_id_received, MSG_ID_INITIAL - 2, __ATOMIC_RELAXED);
+            __atomic_store_n(&s->mav, false, __ATOMIC_RELAXED);
+            __atomic_store_n(&s->clearing, false, __ATOMIC_RELEASE);
+
+            status = server_write(connection, DeviceClearAcknowledge,
+                    s->overlap ? CC_PREFER_OVERLAP : CC_PREFER_SYNC, 0, NULL, 0, 0);
+
+            pthread_mutex_unlock(&connection->write_mutex);
+
+            if (status != 0)
+                return -1;
+            break;
+
+        case Error:
+            break;
+        case FatalError:
+            break;
+        default:
+            break;
+    }
+
+    return 0;
+}
+
+/*
+ * session_mav() - Generate message available (MAV) status bit
+ *
+ * In overlapped mode MAV tells if responses beyond the one with the
+ * MessageID the client last delivered have been sent. In synchronized mode
+ * MAV is set by sending a response and cleared by RMT-delivered, but only
+ * reported to a query for the most recently received message.
+ *
+ */
+
+static bool session_mav(session_t *s, uint32_t message_id)
+{
+    if (__atomic_load_n(&s->overlap, __ATOMIC_RELAXED))
+        return message_id != __atomic_load_n(&s->message_id, __ATOMIC_RELAXED) - 2;
+
+    return __atomic_load_n(&s->mav, __ATOMIC_RELAXED) &&
+        (message_id == __atomic_load_n(&s->message_id_received, __ATOMIC_RELAXED));
+}
+
+/*
+ * hs_dispatch_async() - Dispatch message of asynchronous channel
+ *
+ * Control messages are answered right away on the event loop thread serving
+ * the asynchronous channel, they never wait for the worker pool.
+ *
+ */
+
+static int hs_dispatch_async(connection_t *connection)
+{
+    msg_header_t *msg_header = &connection->msg_header;
+    session_t *s = connection_session(connection);
+
+    switch (msg_header->type)
+    {
+        case AsyncMaximumMessageSize:
+            {
+                uint64_t size;
+                struct iovec iov;
+
+                if (msg_header->payload_length != 8)
+                {
+                    error_printf("Invalid AsyncMaximumMessageSize\n");
+                    return -1;
+                }
+
+                // Largest message client accepts limits what we send
+                memcpy(&size, connection->payload->data, 8);
+                __atomic_store_n(&s->max_message_size_send, be64toh(size), __ATOMIC_RELAXED);
+
+                // Respond with largest message we accept
+                size = htobe64(s->max_message_size_receive);
+                iov.iov_base = &size;
+                iov.iov_len = 8;
+                if (server_send(connection, AsyncMaximumMessageSizeResponse, 0, 0, &iov, 1) != 0)
+                    return -1;
+            }
+            break;
+
+        case AsyncDeviceClear:
+            // Cancel queued and running requests, synchronous channel drops
+            // input until DeviceClearComplete
+            __atomic_add_fetch(&s->clear_generation, 1, __ATOMIC_RELEASE);
+            __atomic_store_n(&s->clearing, true, __ATOMIC_RELEASE);
+
+            // Propose preferred features
+            if (server_send(connection, AsyncDeviceClearAcknowledge,
+                        connection->server->config->overlap_mode ? CC_PREFER_OVERLAP : CC_PREFER_SYNC,
+                        0, NULL, 0) != 0)
+                return -1;
+            break;
+
+        case AsyncStatusQuery:
+            {
+                // Reading status byte clears RQS
+                uint8_t status = __atomic_fetch_and(&s->status, ~STB_RQS, __ATOMIC_ACQ_REL) & ~STB_MAV;
+
+                if (msg_header->control_code & CC_RMT_DELIVERED)
+                    __atomic_store_n(&s->mav, false, __ATOMIC_RELAXED);
+
+                if (session_mav(s, msg_header->parameter))
+                    status |= STB_MAV;
+
+                // Respond with status byte in control code
+                if (server_send(connection, AsyncStatusResponse, status, 0, NULL, 0) != 0)
+                    return -1;
+            }
+            break;
+
+        case AsyncRemoteLocalControl:
+            if (server_send(connection, AsyncRemoteLocalResponse, 0, 0, NULL, 0) != 0)
+                return -1;
+            break;
+
+        case AsyncLock:
+            {
+                int result;
+
+                if ((msg_header->control_code != CC_REQUEST) && (msg_header->control_code != CC_RELEASE))
+                {
+                    error_printf("Unrecognized AsyncLock control code %d\n", msg_header->control_code);
+                    if (server_send_error(connection, ERROR_UNRECOGNIZED_CONTROL_CODE, "Unrecognized control code") != 0)
+                        return -1;
+                    break;
+                }
+
+                if (connection->lock == NULL)
+                    result = CC_REQUEST_RSP_ERROR;
+                else if (msg_header->control_code == CC_REQUEST)
+                {
+                    // Waiting request keeps connection until it completes
+                    connection_get(connection);
+                    result = lock_request(connection->lock, &connection->lock_owner,
+                            connection->payload ? connection->payload->data : "",
+                            msg_header->payload_length, msg_header->parameter);
+                    if (result == LOCK_PENDING)
+                        break;
+                    connection_put(connection);
+                }
+                else if (msg_header->control_code == CC_RELEASE)
+                {
+                    // Released at once, designated message is not waited for
+                    result = lock_release(connection->lock, &connection->lock_owner);
+                }
+
+                if (server_send(connection, AsyncLockResponse, result, 0, NULL, 0) != 0)
+                    return -1;
+            }
+            break;
+
+        case AsyncLockInfo:
+            {
+                bool exclusive = false;
+                int holders = 0;
+
+                // Answered from counters, lock mutex is not taken
+                if (connection->lock != NULL)
+                    lock_info(connection->lock, &exclusive, &holders);
+
+                if (server_send(connection, AsyncLockInfoResponse,
+                            exclusive ? CC_INFO_RSP_EXCLUSIVE_LOCK : CC_INFO_RSP_NO_EXCLUSIVE_LOCK,
+                            holders, NULL, 0) != 0)
+                    return -1;
+            }
+            break;
+
+        case Error:
+            break;
+        case FatalError:
+            break;
+        default:
+            error_printf("Unsupported message type %d on asynchronous channel\n", msg_header->type);
+            if (server_send_error(connection, ERROR_UNRECOGNIZED_MESSAGE_TYPE, "Unrecognized message type") != 0)
+                return -1;
+            break;
+    }
+
+    return 0;
+}
+
+static uint64_t payload_size_max(connection_t *connection)
+{
+    // Synchronous channel accepts what was advertised in AsyncMaximumMessageSizeResponse
+    if ((connection->session >= 0) && !connection->async)
+        return connection_session(connection)->max_message_size_receive - MSG_HEADER_SIZE;
+
+    return connection->server->config->payload_size_max;
+}
+
+static int payload_lease(connection_t *connection)
+{
+    hs_server_t *server = connection->server;
+    uint64_t remaining = connection->msg_header.payload_length - connection->received;
+
+    // Streamed payload is received in chunks of bounded size
+    connection->chunk_size = remaining;
+    if (connection->streaming && (remaining > (uint64_t) server->config->stream_chunk_size))
+        connection->chunk_size = server->config->stream_chunk_size;
+    connection->chunk_length = 0;
+
+    // Lease payload receive buffer (zero terminated for string payloads)
+    connection->payload = pool_get(&connection->pool, connection->chunk_size + 1);
+    if (connection->payload == NULL)
+        return -1;
+    connection->payload->data[connection->chunk_size] = 0;
+
+    return 0;
+}
+
+static bool payload_streaming(connection_t *connection)
+{
+    msg_type_t type = connection->msg_header.type;
+    hs_subaddress_callbacks_t *callbacks = connection_callbacks(connection);
+
+    // Data on asynchronous channel is not a message for the application
+    if (((type != Data) && (type != DataEnd)) || connection->async || (callbacks == NULL))
+        return false;
+
+    return callbacks->message_stream != NULL;
+}
+
+/*
+ * hs_parse() - Parse received messages
+ *
+ * Parses as many complete message headers and payloads as are buffered in
+ * the receive ring and dispatches each complete message. A partially
+ * received message is kept in the connection so parsing resumes whenever
+ * more data arrives. Streamed Data/DataEnd payloads are instead handed over
+ * chunk by chunk as each chunk buffer fills up.
+ *
+ */
+
+static int hs_parse(connection_t *connection)
+{
+    hs_stats_t *stats = connection->server->stats;
+    msg_header_t *msg_header = &connection->msg_header;
+    uint8_t header[MSG_HEADER_SIZE];
+    uint64_t length;
+    int status;
+
+    while (1)
+    {
+        // Rest of input waits until worker queue has space
+        if (connection->paused)
+            return 0;
+
+        if (connection->state == RECEIVE_DISCARD)
+        {
+            // Drop (rest of) rejected payload
+            connection->discard -= ring_skip(&connection->ring, connection->discard);
+            if (connection->discard > 0)
+                return 0;
+
+            connection->state = RECEIVE_HEADER;
+        }
+
+        // Device clear abandons payload being received
+        if ((connection->state == RECEIVE_PAYLOAD) && connection_clearing(connection))
+        {
+            connection->discard = msg_header->payload_length - connection->received;
+            pool_put(connection->payload);
+            connection->payload = NULL;
+            connection->state = RECEIVE_DISCARD;
+            continue;
+        }
+
+        if (connection->state == RECEIVE_HEADER)
+        {
+            // Wait until we have enough bytes representing a message header
+            if (ring_used(&connection->ring) < MSG_HEADER_SIZE)
+                return 0;
+
+            ring_read(&connection->ring, header, MSG_HEADER_SIZE);
+
+            // Verify message header
+            msg_header_decode(msg_header, header);
+            if (msg_header_verify(msg_header))
+            {
+                // Invalid header
+                error_printf("Invalid header\n");
+                stats_add(&stats_thread(stats)->invalid_headers, 1);
+
+                // Send FatalError message with error code 1 (Poorly formed message header)
+                //msg_send(FatalError, 1, 0, error_string(1), error_string_length(1));
+
+                continue; // Skip until valid header received
+            }
+
+            stats_message_in(stats, connection->stats_slot, msg_header->type, msg_header->payload_length);
+            trace_event(HS_TRACE_HEADER, connection->session_id, msg_header->parameter, msg_header->type);
+
+            connection->received = 0;
+
+            // Synchronous channel input to MAV generation
+            if (((msg_header->type == Data) || (msg_header->type == DataEnd)) &&
+                (connection->session >= 0) && !connection->async)
+            {
+                if (msg_header->control_code & CC_RMT_DELIVERED)
+                    __atomic_store_n(&connection_session(connection)->mav, false, __ATOMIC_RELAXED);
+                __atomic_store_n(&connection_session(connection)->message_id_received,
+                        msg_header->parameter, __ATOMIC_RELAXED);
+            }
+
+            // Drop everything but DeviceClearComplete during device clear,
+            // payloads are skipped without being buffered
+            if ((msg_header->type != DeviceClearComplete) && connection_clearing(connection))
+            {
+                connection->discard = msg_header->payload_length;
+                connection->state = RECEIVE_DISCARD;
+                continue;
+            }
+
+            // Data has nowhere to go until Initialize links a subaddress
+            if (((msg_header->type == Data) || (msg_header->type == DataEnd)) &&
+                (connection_callbacks(connection) == NULL))
+            {
+                error_printf("Data received without subaddress\n");
+                stats_add(&stats_thread(stats)->rejected_messages, 1);
+
+                // Report error and skip payload
+                if (server_send_error(connection, ERROR_UNIDENTIFIED, "No subaddress attached") != 0)
+                    return -1;
+                connection->discard = msg_header->payload_length;
+                connection->state = RECEIVE_DISCARD;
+                continue;
+            }
+
+            connection->streaming = payload_streaming(connection);
+
+            if (msg_header->payload_length > 0)
+            {
+                // Check payload size (streamed payload size is unlimited)
+                if (!connection->streaming &&
+                    (msg_header->payload_length > payload_size_max(connection)))
+                {
+                    error_printf("Maximum payload size exceeded\n");
+                    stats_add(&stats_thread(stats)->rejected_messages, 1);
+
+                    // Report error and skip payload
+                    if (server_send_error(connection, ERROR_MESSAGE_TOO_LARGE, "Message too large") != 0)
+                        return -1;
+                    connection->discard = msg_header->payload_length;
+                    connection->state = RECEIVE_DISCARD;
+                    continue;
+                }
+
+                if (payload_lease(connection) != 0)
+                    return -1;
+                connection->state = RECEIVE_PAYLOAD;
+            }
+            else if (connection->streaming)
+            {
+                // Empty DataEnd still ends streamed message
+                if ((msg_header->type == DataEnd) && (stream_submit(connection) != 0))
+                    return -1;
+                continue;
+            }
+        }
+
+        if (connection->state == RECEIVE_PAYLOAD)
+        {
+            // Take (rest of) payload chunk
+            length = ring_read(&connection->ring,
+                    connection->payload->data + connection->chunk_length,
+                    connection->chunk_size - connection->chunk_length);
+            connection->chunk_length += length;
+            connection->received += length;
+
+            if (connection->chunk_length < connection->chunk_size)
+                return 0;
+
+            if (connection->received == msg_header->payload_length)
+                trace_event(HS_TRACE_PAYLOAD, connection->session_id, msg_header->parameter, msg_header->type);
+
+            if (connection->streaming)
+            {
+                // Hand over chunk and continue with next one
+                if (stream_submit(connection) != 0)
+                    return -1;
+
+                if (connection->received < msg_header->payload_length)
+                {
+                    if (payload_lease(connection) != 0)
+                        return -1;
+                }
+                else
+                    connection->state = RECEIVE_HEADER;
+
+                continue;
+            }
+
+            connection->state = RECEIVE_HEADER;
+        }
+
+        // Complete message received
+        if (connection->async)
+            status = hs_dispatch_async(connection);
+        else
+            status = hs_dispatch_sync(connection);
+
+        pool_put(connection->payload);
+        connection->payload = NULL;
+
+        if (status < 0)
+            return -1;
+    }
+}
+
+/*
+ * hs_process() - Receive and process messages
+ *
+ * Performs a single large read into the connection receive ring and parses
+ * all messages received. Remaining payload larger than the ring is read
+ * directly into its payload buffer instead.
+ *
+ * Returns 1 if more data may be available, 0 if the socket has been drained
+ * and -1 if the connection must be closed.
+ *
+ */
+
+static int hs_process(connection_t *connection, int timeout)
+{
+    hs_server_t *server = connection->server;
+    int bytes_received;
+    size_t length;
+    void *buffer;
+    bool direct;
+
+    direct = (connection->state == RECEIVE_PAYLOAD) &&
+             !connection_clearing(connection) &&
+             (ring_used(&connection->ring) == 0) &&
+             (connection->chunk_size - connection->chunk_length >= connection->ring.size);
+
+    if (direct)
+    {
+        buffer = connection->payload->data + connection->chunk_length;
+        length = connection->chunk_size - connection->chunk_length;
+    }
+    else
+        buffer = ring_write_pointer(&connection->ring, &length);
+
+    if (length > SERVER_READ_MAX)
+        length = SERVER_READ_MAX;
+
+    bytes_received = server->tcp_read(connection->socket, buffer, length, timeout);
+
+    if (bytes_received == 0)
+    {
+        printf("Client closed connection\n");
+        return -1;
+    }
+
+    if (bytes_received < 0)
+    {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+            return 0;
+        return -1;
+    }
+
+    if (direct)
+    {
+        connection->chunk_length += bytes_received;
+        connection->received += bytes_received;
+    }
+    else
+        ring_write_commit(&connection->ring, bytes_received);
+
+    if (hs_parse(connection) < 0)
+        return -1;
+
+    // A short read means the socket has been drained
+    return ((size_t) bytes_received < length) ? 0 : 1;
+}
+
+/*
+ * server_lock_complete() - Respond to lock request that waited
+ *
+ * Called from thread granting the lock or failing the request on timeout.
+ *
+ */
+
+static void server_lock_complete(lock_owner_t *owner, int result)
+{
+    connection_t *connection = (connection_t *) ((char *) owner - offsetof(connection_t, lock_owner));
+
+    if (!__atomic_load_n(&connection->closed, __ATOMIC_ACQUIRE))
+        server_send(connection, AsyncLockResponse, result, 0, NULL, 0);
+
+    connection_put(connection);
+}
+
+static void connection_resume(worker_waiter_t *waiter)
+{
+    connection_t *connection = (connection_t *) ((char *) waiter - offsetof(connection_t, waiter));
+
+    reactor_resume(connection->source);
+}
+
+static void *connection_open(int socket, void *data, reactor_source_t *source)
+{
+    connection_t *connection;
+
+    printf("client_socket = %d\n", socket);
+
+    connection = calloc(1, sizeof(connection_t));
+    if (connection == NULL)
+    {
+        error_printf("calloc() failed\n");
+        return NULL;
+    }
+
+    connection->socket = socket;
+    connection->shard = data;
+    connection->server = connection->shard->server;
+    connection->session = -1;
+    connection->refs = 1;
+    connection->state = RECEIVE_HEADER;
+    connection->source = source;
+    connection->waiter.function = connection_resume;
+
+    if (ring_init(&connection->ring, SERVER_RECEIVE_BUFFER_SIZE) != 0)
+    {
+        free(connection);
+        return NULL;
+    }
+
+    // Connection has a full worker queue of requests, one running and one
+    // being received in flight at most
+    pool_init(&connection->pool, connection->server->config->worker_queue_depth_max + 2, SERVER_POOL_CACHE_SIZE);
+
+    pthread_mutex_init(&connection->write_mutex, NULL);
+    worker_queue_init(&connection->queue, request_done);
+
+    stats_add(&stats_thread(connection->server->stats)->connections_opened, 1);
+
+    return connection;
+}
+
+static int connection_input(void *context)
+{
+    connection_t *connection = context;
+    int status = 0;
+
+    // Resumed, first parse what was received before pausing
+    if (connection->paused)
+    {
+        connection->paused = false;
+        if (hs_parse(connection) < 0)
+            return -1;
+    }
+
+    // Consume all available input
+    while (!connection->paused && ((status = hs_process(connection, -1)) > 0));
+
+    if (status < 0)
+        return -1;
+
+    // Worker queue is full, rest of input stays in socket
+    if (connection->paused)
+        return REACTOR_PAUSE;
+
+    // Asynchronous channel continues on event loop of its own
+    if (connection->detach)
+        return REACTOR_DETACH;
+
+    return status;
+}
+
+static void connection_close(void *context)
+{
+    connection_t *connection = context;
+
+    // Cancel any queued requests
+    __atomic_store_n(&connection->closed, true, __ATOMIC_RELEASE);
+
+    // Locks of client are released as soon as its connection closes
+    if ((connection->lock != NULL) && lock_close(connection->lock, &connection->lock_owner))
+        connection_put(connection);
+
+    pool_put(connection->payload);
+    pool_put(connection->message);
+    connection->payload = NULL;
+    connection->message = NULL;
 
-static int server_subaddress_link(hs_server_t *server, char *subaddress, hs_subaddress_data_t *subaddress_data)
+    // Session and socket are released when last queued request is done
+    connection_put(connection);
+}
+
+static void connection_detach(void *context)
 {
-    bool match_found = false;
-    hs_subaddress_data_t *sd;
+    connection_t *connection = context;
 
-    // Lookup subaddress in list of registered subaddresses
-    LIST_FOREACH(sd, subaddress_head, entries)
+    connection->detach = false;
+    connection->source = NULL; // Handle of previous event loop is gone
+
+    // New event loop may close connection any time once it is added
+    connection_get(connection);
+
+    if (reactor_add(connection->shard->async_loop, connection->socket, connection) != 0)
+        connection_close(connection);
+    else
     {
-        if (strcmp(sd->subaddress, subaddress) == 0)
-        {
-            match_found = true;
-            subaddress_data = sd;
-            printf("found subaddress\n");
-            break;
-        }
+        // Client waits for this before sending anything else on the channel
+        server_send(connection, AsyncInitializeResponse, 0, HISLIP_VENDOR_ID, NULL, 0);
+    }
+
+    connection_put(connection);
+}
+
+static void connection_callback(int socket, void *data)
+{
+    hs_server_t *server = ((hs_server_shard_t *) data)->server;
+    connection_t *connection;
+
+    connection = connection_open(socket, data, NULL);
+    if (connection == NULL)
+    {
+        server->tcp_close(socket);
+        return;
     }
 
-    // Link connection session to subaddress
+    // Enter message processing loop (blocking, no timeout)
+    while (hs_process(connection, 0) >= 0);
 
-    return match_found;
+    connection_close(connection);
 }
 
-static void hs_process(int socket, hs_server_t *server)
+static reactor_callbacks_t reactor_callbacks =
 {
-    msg_header_t msg_header;
-    int bytes_received, bytes_sent, i;
-    char *subaddress;
-    void *payload = NULL;
+    .open = connection_open,
+    .input = connection_input,
+    .close = connection_close,
+    .detach = connection_detach,
+};
 
-    // Enter message processing loop
-    while (1)
+static int server_shard_start(hs_server_shard_t *shard, bool reuseport)
+{
+    hs_server_t *server = shard->server;
+    hs_server_config_t *config = server->config;
+    int flags = 0;
+
+    if (reuseport)
+        flags |= TCP_LISTEN_REUSEPORT;
+    if (config->loopback)
+        flags |= TCP_LISTEN_LOOPBACK;
+
+    if (server->io_mode == HS_IO_URING)
+        return uring_start(config->port, config->connections_max, flags,
+                config->io_threads_max, &reactor_callbacks, shard);
+
+    return reactor_start(config->port, config->connections_max, flags,
+            config->io_threads_max, &reactor_callbacks, shard);
+}
+
+static void *server_shard_thread(void *arg)
+{
+    server_shard_start(arg, true);
+
+    return NULL;
+}
+
+int hs_server_run(hs_server_t *server)
+{
+    hs_server_config_t *config = server->config;
+    pthread_t thread;
+    int i;
+
+    // Subaddresses are fixed from now on
+    server->running = true;
+
+    // Start worker threads executing message callbacks
+    for (i=0; i<server->shards_count; i++)
+    {
+        if (worker_pool_init(&server->shards[i].worker_pool, config->worker_threads_max,
+                    config->worker_queue_depth_max) != 0)
+            return -1;
+    }
+
+    // Local transport is served by event loop
+    server->io_mode = config->io_mode;
+    if (config->loopback && (server->io_mode == HS_IO_THREADED))
+        server->io_mode = HS_IO_EPOLL;
+
+    // Fall back to epoll where io_uring is missing or disabled
+    if (server->io_mode == HS_IO_URING)
     {
-        /* 1. Receive message (blocking, no timeout)
-         * 1.1 Receive header
-         * 1.2 Decode payload length
-         * 1.3 Allocate payload length memory
-         * 1.4 Receive payload length
-         * 2. Decode message
-         * 3. Execute request
-         * 4. Send response (blocking, with timeout)
-         */
-
-        // Receive message header (blocking until data available)
-        if ((bytes_received = server->tcp_read(socket, &msg_header, MSG_HEADER_SIZE, 0)) == 0)
+        if (uring_available())
+            server->tcp_read = uring_read;
+        else
         {
-            printf("Client closed connection\n");
-            server->tcp_close(socket);
-            return;
+            printf("io_uring not available, using epoll\n");
+            server->io_mode = HS_IO_EPOLL;
         }
+    }
 
-        // Skip until we have enough bytes representing a message header
-        if (bytes_received < MSG_HEADER_SIZE)
-            continue;
-
-        // Verify message header
-        if (msg_header_verify(&msg_header))
+    // Start event loops serving asynchronous channels
+    if (server->io_mode != HS_IO_THREADED)
+    {
+        for (i=0; i<server->shards_count; i++)
         {
-            // Invalid header
-            error_printf("Invalid header\n");
+            server->shards[i].async_loop = reactor_create(&reactor_callbacks);
+            if (server->shards[i].async_loop == NULL)
+                return -1;
+        }
+    }
 
-            // Send FatalError message with error code 1 (Poorly formed message header)
-            //msg_send(FatalError, 1, 0, error_string(1), error_string_length(1));
+    // Start server
+    printf("Starting HiSlip server\n");
 
-            continue; // Skip until valid header received
-        }
+    switch (server->io_mode)
+    {
+        case HS_IO_EPOLL:
+        case HS_IO_URING:
+            if (server->shards_count == 1)
+                return server_shard_start(&server->shards[0], false);
 
-        // Receive any payload
-        if (msg_header.payload_length > 0)
-        {
-            // Check payload size
-            if (msg_header.payload_length > server->config->payload_size_max)
+            // Each shard listens on the port with its own socket
+            for (i=1; i<server->shards_count; i++)
             {
-                error_printf("Maximum payload size exceeded\n");
-                continue;
+                if (pthread_create(&thread, NULL, server_shard_thread, &server->shards[i]) != 0)
+                {
+                    error_printf("pthread_create() failed\n");
+                    return -1;
+                }
+                pthread_detach(thread);
             }
 
-            // Allocate payload receive buffer
-            payload = malloc(msg_header.payload_length);
-            if (payload == NULL)
-            {
-                error_printf("malloc() failed\n");
-                continue;
-            }
+            printf("Running %d shards\n", server->shards_count);
 
-            // Read payload
-            if ((bytes_received = server->tcp_read(socket, payload, msg_header.payload_length, 0)) == 0)
-            {
-                printf("Client closed connection\n");
-                server->tcp_close(socket);
-                return;
-            }
-        }
+            return server_shard_start(&server->shards[0], true);
 
-        // Perform action depending on message type
-        switch (msg_header.type)
-        {
-            case Initialize:
-                {
-                    // Decode parameter field:
-                    //  Client protocol version (upper)
-                    //  Client vendor id (lower)
-                    uint16_t *value = (uint16_t *) &msg_header.parameter;
-                    uint16_t client_vendor_id = *value;
-                    uint16_t client_protocol_version = *(value+1);
-
-                    // Check if HiSlip protocol version is supported
-                    if (client_protocol_version != SERVER_PROTOCOL_VERSION)
-                    {
-                        error_printf("Unsupported protocol version\n");
-                        server->tcp_close(socket);
-                        return;
-                    }
-                }
+        case HS_IO_THREADED:
+        default:
+            server->tcp_start(config->port, config->connections_max, connection_callback, &server->shards[0]);
+            break;
+    }
 
-                // Create new connection session
-                i = session_new();
-                if (i < 0)
-                {
-                    error_printf("Could not allocate new session!\n");
-                    server->tcp_close(socket);
-                    return;
-                }
+    return 0;
+}
 
-                // Link connection session with registered subaddress callbacks
-                subaddress = payload;
-                if (server_subaddress_link(server, subaddress, session[i].subaddress_data) == -1)
-                {
-                    error_printf("Unable to link subaddress\n");
-                    // TODO: Respond FatalError
-                    continue;
-                }
+int hs_send_response(hs_request_t *request, void *message, int length)
+{
+    struct iovec iov;
 
-                // Send InitializeResponse message including
-                //  SessionID
-                //  Overlap-mode
-                //  Server protocol version
+    iov.iov_base = message;
+    iov.iov_len = length;
 
-                break;
+    return hs_send_responsev(request, &iov, 1);
+}
 
-            case InitializeResponse:
-                break;
-            case AsyncInitialize:
-                break;
-            case AsyncInitializeResponse:
-                break;
-            case Data:
-                break;
-            case DataEnd:
-                break;
-            case AsyncMaximumMessageSize:
-                break;
-            case AsyncMaximumMessageSizeResponse:
-                break;
-            case Error:
-                break;
-            case FatalError:
-                break;
-            default:
-                break;
+int hs_send_responsev(hs_request_t *request, const struct iovec *iov, int iovcnt)
+{
+    // Send message answering request
+    return server_send_data(request, iov, iovcnt);
+}
+
+int hs_request_retain(hs_request_t *request)
+{
+    // Keep request and its message buffer after callback returns
+    __atomic_add_fetch(&request->refs, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+int hs_request_release(hs_request_t *request)
+{
+    request_put(request);
+
+    return 0;
+}
+
+/*
+ * hs_request_cancelled() - Check if request was cancelled
+ *
+ * Returns true once a device clear has cancelled request. Long running
+ * callbacks should poll this and give up early, responses to cancelled
+ * requests are dropped anyway.
+ *
+ */
+
+bool hs_request_cancelled(hs_request_t *request)
+{
+    return request_cancelled(request);
+}
+
+/*
+ * hs_request_locked() - Check if client of request holds lock
+ *
+ * Locks are advisory, requests of clients not holding the lock are
+ * delivered all the same. Callbacks honouring locks use this to refuse
+ * them. Returns true if the client holds the lock of the subaddress, and
+ * sets exclusive (if not NULL) to tell whether it is the exclusive lock.
+ *
+ */
+
+bool hs_request_locked(hs_request_t *request, bool *exclusive)
+{
+    session_t *s = connection_session(request->connection);
+    connection_t *channel = __atomic_load_n(&s->channel_async, __ATOMIC_ACQUIRE);
+    bool held = false, held_exclusive = false;
+
+    // Locks are held by asynchronous channel of session
+    if ((channel != NULL) && (channel->lock != NULL))
+        held = lock_held(channel->lock, &channel->lock_owner, &held_exclusive);
+
+    if (exclusive != NULL)
+        *exclusive = held_exclusive;
+
+    return held;
+}
+
+/*
+ * hs_request_session() - Get session of request
+ *
+ * Returns handle of the session request belongs to. Unlike the request it
+ * stays usable after the callback returns, for setting the status byte and
+ * requesting service at any later time. Once the client is gone the
+ * session calls fail.
+ *
+ */
+
+hs_session_t hs_request_session(hs_request_t *request)
+{
+    return request->connection->session_id;
+}
+
+static void session_status_set(session_t *s, uint8_t status)
+{
+    uint8_t previous = __atomic_load_n(&s->status, __ATOMIC_RELAXED);
+
+    while (!__atomic_compare_exchange_n(&s->status, &previous,
+                (status & ~STB_RQS) | (previous & STB_RQS), true,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+}
+
+static int session_service_request(session_t *s, connection_t *channel, uint8_t status)
+{
+    uint32_t raised;
+    bool sending = false;
+
+    if ((channel == NULL) || __atomic_load_n(&channel->closed, __ATOMIC_ACQUIRE))
+    {
+        error_printf("No asynchronous channel\n");
+        return -1;
+    }
+
+    __atomic_store_n(&s->status, (status & ~STB_MAV) | STB_RQS, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&s->srq_raised, 1, __ATOMIC_ACQ_REL);
+
+    // Thread already sending picks up this request when it is done
+    if (!__atomic_compare_exchange_n(&s->srq_sending, &sending, true, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return 0;
+
+    do
+    {
+        // Message carries status at the time it is sent. MAV depends on the
+        // MessageID a query names, so only AsyncStatusQuery reports it.
+        raised = __atomic_load_n(&s->srq_raised, __ATOMIC_ACQUIRE);
+        status = __atomic_load_n(&s->status, __ATOMIC_ACQUIRE) & ~STB_MAV;
+
+        if (server_send(channel, AsyncServiceRequest, status, 0, NULL, 0) != 0)
+        {
+            __atomic_store_n(&s->srq_sending, false, __ATOMIC_RELEASE);
+            return -1;
         }
+
+        __atomic_store_n(&s->srq_sending, false, __ATOMIC_RELEASE);
+        sending = false;
     }
+    while ((__atomic_load_n(&s->srq_raised, __ATOMIC_ACQUIRE) != raised) &&
+           __atomic_compare_exchange_n(&s->srq_sending, &sending, true, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    return 0;
 }
 
-static void connection_callback(int socket, void *data)
+/*
+ * server_session_find() - Find session by SessionID
+ *
+ * Returns session or NULL if it is gone. Caller must hold channel mutex of
+ * table, which keeps session from being freed.
+ *
+ */
+
+static session_t *server_session_find(session_table_t *sessions, hs_session_t session)
 {
-    printf("client_socket = %d\n", socket);
+    int i = session_table_lookup(sessions, session);
+
+    if (i < 0)
+    {
+        error_printf("Unknown session %u\n", session);
+        return NULL;
+    }
 
-    hs_process(socket, data);
+    return &sessions->entry[i];
 }
 
-int hs_server_run(hs_server_t *server)
+/*
+ * hs_set_status() - Set status byte
+ *
+ * Sets the status byte (STB) of the session request belongs to. The async
+ * channel answers AsyncStatusQuery straight from it, without calling into
+ * the application. Bits 4 (MAV) and 6 (RQS) are generated by the server and
+ * ignored here.
+ *
+ */
+
+int hs_set_status(hs_request_t *request, uint8_t status)
 {
-    // Start server
-    printf("Starting HiSlip server\n");
-    server->tcp_start(server->config->port, server->config->connections_max, connection_callback, server);
+    session_status_set(connection_session(request->connection), status);
+
+    return 0;
+}
+
+uint8_t hs_get_status(hs_request_t *request)
+{
+    return __atomic_load_n(&connection_session(request->connection)->status, __ATOMIC_RELAXED);
+}
+
+/*
+ * hs_service_request() - Request service
+ *
+ * Sets the status byte of the session request belongs to and raises RQS by
+ * sending AsyncServiceRequest on its async channel. May be called from any
+ * thread while request is retained. Service requests raised while another
+ * is being sent only update the status byte and are covered by a single
+ * further message carrying the latest status, so bursts are coalesced yet
+ * every request is followed by a message. RQS stays set in the status byte
+ * until the client reads it.
+ *
+ */
+
+int hs_service_request(hs_request_t *request, uint8_t status)
+{
+    session_t *s = connection_session(request->connection);
+
+    return session_service_request(s, __atomic_load_n(&s->channel_async, __ATOMIC_ACQUIRE), status);
+}
+
+/*
+ * hs_server_set_status() - Set status byte of session
+ *
+ * As hs_set_status() for a session from hs_request_session(), from any
+ * thread and with no request at hand.
+ *
+ */
+
+int hs_server_set_status(hs_server_t *server, hs_session_t session, uint8_t status)
+{
+    session_table_t *sessions = server_session_table(server, session);
+    session_t *s;
+
+    pthread_mutex_lock(&sessions->channel_mutex);
+
+    s = server_session_find(sessions, session);
+    if (s != NULL)
+        session_status_set(s, status);
+
+    pthread_mutex_unlock(&sessions->channel_mutex);
+
+    return (s != NULL) ? 0 : -1;
+}
+
+int hs_server_get_status(hs_server_t *server, hs_session_t session, uint8_t *status)
+{
+    session_table_t *sessions = server_session_table(server, session);
+    session_t *s;
+
+    pthread_mutex_lock(&sessions->channel_mutex);
+
+    s = server_session_find(sessions, session);
+    if (s != NULL)
+        *status = __atomic_load_n(&s->status, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&sessions->channel_mutex);
+
+    return (s != NULL) ? 0 : -1;
+}
+
+/*
+ * hs_server_service_request() - Request service of session
+ *
+ * As hs_service_request() for a session from hs_request_session(), from
+ * any thread and with no request at hand.
+ *
+ */
+
+int hs_server_service_request(hs_server_t *server, hs_session_t session, uint8_t status)
+{
+    session_table_t *sessions = server_session_table(server, session);
+    connection_t *channel = NULL;
+    session_t *s;
+    int result;
+
+    pthread_mutex_lock(&sessions->channel_mutex);
+
+    // Reference on asynchronous channel keeps session until it is dropped
+    s = server_session_find(sessions, session);
+    if (s != NULL)
+    {
+        channel = __atomic_load_n(&s->channel_async, __ATOMIC_ACQUIRE);
+        if (channel != NULL)
+            connection_get(channel);
+    }
+
+    pthread_mutex_unlock(&sessions->channel_mutex);
+
+    if (s == NULL)
+        return -1;
+
+    result = session_service_request(s, channel, status);
+
+    if (channel != NULL)
+        connection_put(channel);
+
+    return result;
+}
+
+/*
+ * hs_server_get_stats() - Get server statistics
+ *
+ * Fills in message, byte and callback time counters of subaddress, or of
+ * all subaddresses if subaddress is NULL, and the server wide counters.
+ * Counters are kept per thread and only summed up here, so reading them
+ * never slows down message processing. Messages received before a
+ * connection is linked to a subaddress (Initialize, AsyncInitialize) only
+ * count in the totals.
+ *
+ */
+
+int hs_server_get_stats(hs_server_t *server, char *subaddress, hs_server_stats_t *stats)
+{
+    session_table_t *sessions;
+    hs_subaddress_data_t *sd;
+    int i, j, slot = -1;
+
+    if (subaddress != NULL)
+    {
+        sd = server_subaddress_lookup(server, subaddress);
+        if (sd == NULL)
+        {
+            error_printf("Unknown subaddress\n");
+            return -1;
+        }
+        slot = sd->index;
+    }
+
+    memset(stats, 0, sizeof(hs_server_stats_t));
+    stats_sum(server->stats, slot, stats);
+
+    for (i=0; i<server->shards_count; i++)
+    {
+        // Gauges are read directly from shard state
+        sessions = &server->shards[i].sessions;
+        for (j=0; j<sessions->capacity; j++)
+        {
+            if (__atomic_load_n(&sessions->entry[j].allocated, __ATOMIC_RELAXED))
+                stats->sessions_active++;
+        }
+
+        stats->queue_depth += __atomic_load_n(&server->shards[i].worker_pool.depth, __ATOMIC_RELAXED);
+        stats->queue_full += __atomic_load_n(&server->shards[i].worker_pool.full, __ATOMIC_RELAXED);
+    }
 
     return 0;
 }
@@ -236,27 +1894,66 @@ int hs_server_config_init(hs_server_config_t *config)
     // Initialize server configuration with default values
     config->port = HISLIP_PORT;
     config->connections_max = 1;
+    config->sessions_max = 256;
+    config->shards = 1;
+    config->loopback = false;
     config->worker_threads_max = 1;
     config->worker_queue_depth_max = 10;
     config->payload_size_max = 0x400000; // 4 MB
     config->message_timeout = 5000; // 5 seconds
+    config->io_mode = HS_IO_THREADED;
+    config->io_threads_max = 1;
+    config->stream_chunk_size = 0x10000; // 64 KB
+    config->overlap_mode = false;
 
     return 0;
 }
 
 int hs_server_init(hs_server_t *server, hs_server_config_t *config)
 {
+    int i;
+
     // Intialize subaddress list
-    subaddress_head = malloc(sizeof(subaddress_head_t));
-    LIST_INIT(subaddress_head);
+    LIST_INIT(&server->subaddresses);
 
     // Set configuration
     server->config = config;
 
+    server->subaddresses_count = 0;
+    server->running = false;
+    server->stats = stats_create(server);
+    if (server->stats == NULL)
+        return -1;
+
+    // Sharding requires event loop mode
+    server->shards_count = 1;
+    if ((config->io_mode != HS_IO_THREADED) && (!config->loopback) && (config->shards > 1))
+        server->shards_count = config->shards;
+
+    for (server->shard_bits=0; (1 << server->shard_bits) < server->shards_count; server->shard_bits++);
+
+    // Allocate shards, each with a session table of its own
+    server->shards = calloc(server->shards_count, sizeof(hs_server_shard_t));
+    if (server->shards == NULL)
+    {
+        error_printf("calloc() failed\n");
+        return -1;
+    }
+
+    for (i=0; i<server->shards_count; i++)
+    {
+        server->shards[i].server = server;
+        server->shards[i].number = i;
+        if (session_table_init(&server->shards[i].sessions, config->sessions_max,
+                    server->shard_bits, i) != 0)
+            return -1;
+    }
+
     // Configure TCP callbacks
     server->tcp_start = tcp_server_start;
     server->tcp_read = tcp_read;
     server->tcp_write = tcp_write;
+    server->tcp_writev = tcp_writev;
     server->tcp_close = tcp_disconnect;
 
     return 0;
@@ -264,6 +1961,14 @@ int hs_server_init(hs_server_t *server, hs_server_config_t *config)
 
 int hs_server_register_subaddress(hs_server_t *server, char *subaddress, hs_subaddress_callbacks_t *callbacks)
 {
+    // Subaddress list and statistics slots are read without locks once
+    // server runs
+    if (server->running)
+    {
+        error_printf("Server already running\n");
+        return -1;
+    }
+
     // Add subaddres to list of registered subaddresses
     server->subaddress_data = malloc(sizeof(hs_subaddress_data_t));
     if (server->subaddress_data == NULL)
@@ -272,12 +1977,20 @@ int hs_server_register_subaddress(hs_server_t *server, char *subaddress, hs_suba
         return -1;
     }
 
+    server->subaddress_data->lock = lock_create(server_lock_complete);
+    if (server->subaddress_data->lock == NULL)
+    {
+        free(server->subaddress_data);
+        return -1;
+    }
+
     // Install subaddress data
     server->subaddress_data->callbacks = callbacks;
     server->subaddress_data->subaddress = subaddress;
+    server->subaddress_data->index = ++server->subaddresses_count;
 
     // Add to list
-    LIST_INSERT_HEAD(subaddress_head, server->subaddress_data, entries);
+    LIST_INSERT_HEAD(&server->subaddresses, server->subaddress_data, entries);
 
     return 0;
 }
@@ -29,72 +29,228 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
 #include <pthread.h>
 #include "session.h"
 #include "error.h"
+#include "message.h"
 
-static uint16_t session_id = 0;
 static pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
-session_t session[MAX_SESSIONS] = {};
 
-int session_new(void)
+// Default table (client sessions)
+static session_table_t session_table;
+session_t *session = NULL;
+int session_capacity = 0;
+
+static void session_push(session_table_t *table, int i)
+{
+    uint64_t head, next;
+
+    head = __atomic_load_n(&table->free_head, __ATOMIC_RELAXED);
+    do
+    {
+        table->entry[i].free_next = head & 0xffffffff;
+        next = ((head >> 32) + 1) << 32 | (uint32_t) (i + 1);
+    }
+    while (!__atomic_compare_exchange_n(&table->free_head, &head, next, true,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static int session_pop(session_table_t *table)
+{
+    uint64_t head, next;
+    uint32_t i;
+
+    head = __atomic_load_n(&table->free_head, __ATOMIC_ACQUIRE);
+    do
+    {
+        i = head & 0xffffffff;
+        if (i == 0)
+            return -1;
+        next = ((head >> 32) + 1) << 32 |
+            __atomic_load_n(&table->entry[i - 1].free_next, __ATOMIC_RELAXED);
+    }
+    while (!__atomic_compare_exchange_n(&table->free_head, &head, next, true,
+                __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    return i - 1;
+}
+
+/*
+ * session_table_init() - Allocate session table
+ *
+ * Sets up table of capacity sessions. SessionIDs handed out by the table
+ * hold the table number in their upper table_bits bits, the entry index in
+ * the lowest bits and a reuse count in between, so the owning table and
+ * entry of any SessionID are found in O(1).
+ *
+ */
+
+int session_table_init(session_table_t *table, int capacity, int table_bits, int table_number)
 {
-    bool session_available = false;
     int i;
 
-    pthread_mutex_lock(&session_mutex);
+    memset(table, 0, sizeof(session_table_t));
+
+    for (table->index_bits=0; (1 << table->index_bits) < capacity; table->index_bits++);
 
-    // Find a free session entry (i)
-    for (i=0; i<MAX_SESSIONS; i++)
+    // At least one bit of reuse count keeps a stale SessionID from naming
+    // the next owner of its entry
+    if ((capacity <= 0) || (table->index_bits + table_bits >= 16))
     {
-        if (session[i].allocated == false)
-        {
-            // Claim session
-            session[i].allocated = true;
-            session[i].SessionID = session_id++;
-            session_available = true;
-            break;
-        }
+        error_printf("Invalid session capacity %d\n", capacity);
+        return -1;
     }
 
-    pthread_mutex_unlock(&session_mutex);
+    if (posix_memalign((void **) &table->entry, SESSION_CACHE_LINE_SIZE, capacity * sizeof(session_t)) != 0)
+    {
+        error_printf("Could not allocate session table\n");
+        return -1;
+    }
+    memset(table->entry, 0, capacity * sizeof(session_t));
+
+    table->capacity = capacity;
+    table->table_bits = table_bits;
+    table->generation_mask = (1 << (16 - table_bits - table->index_bits)) - 1;
+    table->id_prefix = table_bits ? table_number << (16 - table_bits) : 0;
+    pthread_mutex_init(&table->channel_mutex, NULL);
+
+    // Lowest entries are handed out first
+    for (i=capacity-1; i>=0; i--)
+        session_push(table, i);
 
-    // Return error if no session can be allocated
-    if (session_available == false)
+    return 0;
+}
+
+int session_table_new(session_table_t *table)
+{
+    session_t *s;
+    int i;
+
+    // Claim free session entry (i)
+    i = session_pop(table);
+    if (i < 0)
     {
         error_printf("Too many active sessions!\n");
         return -1;
     }
 
+    s = &table->entry[i];
+    s->generation = (s->generation + 1) & table->generation_mask;
+    // Lookups read SessionID of freed entries too, see session_table_lookup()
+    __atomic_store_n(&s->SessionID, table->id_prefix | (s->generation << table->index_bits) | i,
+            __ATOMIC_RELAXED);
+    s->socket_sync = -1;
+    s->socket_async = -1;
+    s->subaddress_data = NULL;
+    s->max_message_size_send = UINT64_MAX;
+    s->max_message_size_receive = UINT64_MAX;
+    s->overlap = false;
+    s->message_id = MSG_ID_INITIAL;
+    s->clearing = false;
+    s->status = 0;
+    s->mav = false;
+    s->srq_raised = 0;
+    s->srq_sending = false;
+    s->message_id_received = MSG_ID_INITIAL - 2;
+    s->channel_async = NULL;
+    s->channel_closed = false;
+    s->data = NULL;
+
+    // Publish initialized session to session_table_lookup()
+    __atomic_store_n(&s->allocated, true, __ATOMIC_RELEASE);
+
     // Return session handle
     return i;
 }
 
-int session_free(int i)
+int session_table_free(session_table_t *table, int i)
 {
-    pthread_mutex_lock(&session_mutex);
+    bool allocated = true;
 
     // Check session handle
-    if ((i >= MAX_SESSIONS) || (i < 0))
+    if ((i >= table->capacity) || (i < 0))
     {
         error_printf("Invalid session handle");
-        goto error;
+        return -1;
     }
 
     // Check if already freed
-    if (session[i].allocated == false)
+    if (!__atomic_compare_exchange_n(&table->entry[i].allocated, &allocated, false, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
     {
         error_printf("Error: Session already freed\n");
-        goto error;
+        return -1;
     }
-   
-    // Free session
-    session[i].allocated = false;
-    pthread_mutex_unlock(&session_mutex);
+
+    session_push(table, i);
+
     return 0;
+}
+
+int session_table_lookup(session_table_t *table, uint16_t SessionID)
+{
+    int i;
+
+    // Entry index is part of SessionID, entry may be freed and reused
+    // concurrently so SessionID is read atomically
+    i = SessionID & ((1 << table->index_bits) - 1);
+    if ((i >= table->capacity) ||
+        (!__atomic_load_n(&table->entry[i].allocated, __ATOMIC_ACQUIRE)) ||
+        (__atomic_load_n(&table->entry[i].SessionID, __ATOMIC_RELAXED) != SessionID))
+        return -1;
+
+    return i;
+}
+
+/*
+ * session_init() - Allocate default session table
+ *
+ * Only the first call has effect, session_new() falls back to a table of
+ * MAX_SESSIONS entries.
+ *
+ */
+
+int session_init(int capacity)
+{
+    int status = 0;
+
+    pthread_mutex_lock(&session_mutex);
+
+    if (session == NULL)
+    {
+        status = session_table_init(&session_table, capacity, 0, 0);
+        if (status == 0)
+        {
+            session_capacity = capacity;
+            __atomic_store_n(&session, session_table.entry, __ATOMIC_RELEASE);
+        }
+    }
 
-error:
     pthread_mutex_unlock(&session_mutex);
-    return -1;
+
+    return status;
+}
+
+int session_new(void)
+{
+    if ((__atomic_load_n(&session, __ATOMIC_ACQUIRE) == NULL) && (session_init(MAX_SESSIONS) != 0))
+        return -1;
+
+    return session_table_new(&session_table);
+}
+
+int session_free(int i)
+{
+    return session_table_free(&session_table, i);
+}
+
+int session_lookup(uint16_t SessionID)
+{
+    if (session == NULL)
+        return -1;
+
+    return session_table_lookup(&session_table, SessionID);
 }
@@ -35,27 +35,101 @@
 #include <pthread.h>
 #include <stdint.h>
 #include <hislip/server.h>
+#include "message.h"
 
-#define MAX_SESSIONS 256
+#define MAX_SESSIONS 256 // Default capacity
+#define SESSION_CACHE_LINE_SIZE 64
 
+// Session table entry. State only the client keeps is held by the client
+// alongside its table. Entries are cache line aligned so sessions served by
+// different threads do not share lines.
 typedef struct
 {
     bool allocated;
 
+    // Free list link (index + 1, 0 terminates)
+    uint32_t free_next;
+
+    // Reuse count of entry, makes SessionIDs of successive owners differ
+    uint16_t generation;
+
     int socket_sync;
     int socket_async;
     uint16_t SessionID;
 
     hs_subaddress_data_t *subaddress_data;
 
+    // Largest messages (including header) peer accepts and we accept on the
+    // synchronous channel, negotiated by AsyncMaximumMessageSize
+    uint64_t max_message_size_send;
+    uint64_t max_message_size_receive;
+
+    // Overlapped or synchronized mode
+    bool overlap;
+
+    // Next MessageID to send (client requests or overlapped server responses)
+    uint32_t message_id;
+
+    // Server device clear: generation is bumped by every AsyncDeviceClear,
+    // cancelling requests of earlier generations, and synchronous channel
+    // input is dropped while clearing until DeviceClearComplete
+    uint32_t clear_generation;
+    bool clearing;
+
+    // Server status byte (STB) answering AsyncStatusQuery. MAV is generated
+    // from mav and the MessageID of the last Data/DataEnd received.
+    uint8_t status;
+    bool mav;
+
+    // Server service requests raised and one of them being sent
+    uint32_t srq_raised;
+    bool srq_sending;
+
+    // MessageID of last Data/DataEnd received (server) or of last response
+    // delivered (client)
+    uint32_t message_id_received;
+
+    // Server asynchronous channel, referenced by session until synchronous
+    // channel is gone so service requests can be sent from any thread. Once
+    // channel_closed is set no channel is linked anymore.
+    void *channel_async;
+    bool channel_closed;
+
     // Session data
     void *data;
-} session_t;
+} __attribute__((aligned(SESSION_CACHE_LINE_SIZE))) session_t;
+
+typedef struct
+{
+    session_t *entry;
+    int capacity;
+
+    // Lock-free free list head: ABA tag in upper half, entry index + 1 in lower
+    uint64_t free_head;
+
+    // SessionID layout: table number, reuse count, entry index
+    int index_bits;
+    int table_bits;
+    int generation_mask;
+    uint16_t id_prefix;
+
+    // Serializes linking of server asynchronous channels to sessions, and
+    // freeing of server sessions against lookups by SessionID
+    pthread_mutex_t channel_mutex;
+} session_table_t;
+
+int session_table_init(session_table_t *table, int capacity, int table_bits, int table_number);
+int session_table_new(session_table_t *table);
+int session_table_free(session_table_t *table, int i);
+int session_table_lookup(session_table_t *table, uint16_t SessionID);
 
-extern session_t session[MAX_SESSIONS];
-//extern pthread_mutex_t session_mutex;
+// Default table
+extern session_t *session;
+extern int session_capacity;
 
+int session_init(int capacity);
 int session_new(void);
 int session_free(int i);
+int session_lookup(uint16_t SessionID);
 
 #endif
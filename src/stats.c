@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2017  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <hislip/server.h>
+#include "stats.h"
+#include "error.h"
+
+// Unlisted counters for threads whose counters could not be allocated
+static struct
+{
+    stats_thread_t thread;
+    stats_slot_t slot[1];
+} stats_fallback = { .thread.slots = 1 };
+
+hs_stats_t *stats_create(hs_server_t *server)
+{
+    hs_stats_t *stats;
+
+    stats = calloc(1, sizeof(hs_stats_t));
+    if (stats == NULL)
+    {
+        error_printf("calloc() failed\n");
+        return NULL;
+    }
+
+    if (pthread_key_create(&stats->key, NULL) != 0)
+    {
+        error_printf("pthread_key_create() failed\n");
+        free(stats);
+        return NULL;
+    }
+
+    pthread_mutex_init(&stats->mutex, NULL);
+    stats->server = server;
+
+    return stats;
+}
+
+/*
+ * stats_thread_register() - Get counters of calling thread
+ *
+ * Looks up the counters of the calling thread, allocating them on first use.
+ * Counters are never freed so counts of exited threads are kept. Only
+ * called when a thread first counts for a server, the lock taken here is
+ * never on the hot path.
+ *
+ */
+
+stats_thread_t *stats_thread_register(hs_stats_t *stats)
+{
+    stats_thread_t *thread;
+    size_t size;
+    int slots;
+
+    pthread_mutex_lock(&stats->mutex);
+
+    for (thread=stats->threads; thread != NULL; thread=thread->next)
+    {
+        if (pthread_equal(thread->owner, pthread_self()))
+            goto out;
+    }
+
+    // One slot per registered subaddress plus one for unassigned
+    slots = stats->server->subaddresses_count + 1;
+    size = sizeof(stats_thread_t) + slots * sizeof(stats_slot_t);
+    size = (size + STATS_CACHE_LINE_SIZE - 1) & ~(size_t) (STATS_CACHE_LINE_SIZE - 1);
+
+    // Cache line aligned so threads never write to the same line
+    if (posix_memalign((void **) &thread, STATS_CACHE_LINE_SIZE, size) != 0)
+    {
+        error_printf("posix_memalign() failed\n");
+
+        // Counts go nowhere, spares callers from checking
+        thread = &stats_fallback.thread;
+        goto out;
+    }
+
+    memset(thread, 0, size);
+    thread->owner = pthread_self();
+    thread->slots = slots;
+
+    // Publish, readers walk list under mutex
+    thread->next = stats->threads;
+    stats->threads = thread;
+
+out:
+    pthread_setspecific(stats->key, thread);
+    pthread_mutex_unlock(&stats->mutex);
+
+    return thread;
+}
+
+static uint64_t stats_read(uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/*
+ * stats_sum() - Aggregate counters of all threads
+ *
+ * Adds the counters of subaddress slot, or of all slots if slot is
+ * negative, together with the server wide counters to sum.
+ *
+ */
+
+int stats_sum(hs_stats_t *stats, int slot, hs_server_stats_t *sum)
+{
+    stats_thread_t *thread;
+    stats_slot_t *s;
+    uint64_t opened = 0, closed = 0;
+    int i, j;
+
+    pthread_mutex_lock(&stats->mutex);
+
+    for (thread=stats->threads; thread != NULL; thread=thread->next)
+    {
+        for (i=0; i<thread->slots; i++)
+        {
+            if ((slot >= 0) && (i != slot))
+                continue;
+
+            s = &thread->slot[i];
+            for (j=0; j<HS_STATS_MESSAGE_TYPES; j++)
+            {
+                sum->messages_in[j] += stats_read(&s->messages_in[j]);
+                sum->bytes_in[j] += stats_read(&s->bytes_in[j]);
+                sum->messages_out[j] += stats_read(&s->messages_out[j]);
+                sum->bytes_out[j] += stats_read(&s->bytes_out[j]);
+            }
+            for (j=0; j<HS_STATS_HISTOGRAM_BUCKETS; j++)
+                sum->callback_time[j] += stats_read(&s->callback_time[j]);
+        }
+
+        opened += stats_read(&thread->connections_opened);
+        closed += stats_read(&thread->connections_closed);
+        sum->rejected_sessions += stats_read(&thread->rejected_sessions);
+        sum->rejected_messages += stats_read(&thread->rejected_messages);
+        sum->invalid_headers += stats_read(&thread->invalid_headers);
+        if (stats_read(&thread->pool_allocated_max) > sum->pool_allocated_max)
+            sum->pool_allocated_max = stats_read(&thread->pool_allocated_max);
+        if (stats_read(&thread->pool_leased_max) > sum->pool_leased_max)
+            sum->pool_leased_max = stats_read(&thread->pool_leased_max);
+    }
+
+    pthread_mutex_unlock(&stats->mutex);
+
+    // Connections may be opened and closed by different threads
+    sum->connections_active = (opened > closed) ? opened - closed : 0;
+
+    return 0;
+}
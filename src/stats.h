@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2017  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <hislip/server.h>
+
+#define STATS_CACHE_LINE_SIZE 64
+#define STATS_SLOT_UNASSIGNED 0 // Connections not (yet) linked to a subaddress
+
+// Counters of one subaddress
+typedef struct
+{
+    uint64_t messages_in[HS_STATS_MESSAGE_TYPES];
+    uint64_t bytes_in[HS_STATS_MESSAGE_TYPES];
+    uint64_t messages_out[HS_STATS_MESSAGE_TYPES];
+    uint64_t bytes_out[HS_STATS_MESSAGE_TYPES];
+    uint64_t callback_time[HS_STATS_HISTOGRAM_BUCKETS];
+} stats_slot_t;
+
+// Counters only ever written by the thread owning them, so counting needs
+// neither locks nor atomic read-modify-write operations. Readers sum up
+// the counters of all threads.
+typedef struct stats_thread_t
+{
+    struct stats_thread_t *next;
+    pthread_t owner;
+
+    uint64_t connections_opened;
+    uint64_t connections_closed;
+    uint64_t rejected_sessions;
+    uint64_t rejected_messages;
+    uint64_t invalid_headers;
+
+    // Buffer pool high-water marks of connections closed by thread
+    uint64_t pool_allocated_max;
+    uint64_t pool_leased_max;
+
+    int slots;
+    stats_slot_t slot[];
+} __attribute__((aligned(STATS_CACHE_LINE_SIZE))) stats_thread_t;
+
+struct hs_stats_t
+{
+    pthread_mutex_t mutex;
+    stats_thread_t *threads;
+    hs_server_t *server;
+
+    // Counters of calling thread
+    pthread_key_t key;
+};
+
+hs_stats_t *stats_create(hs_server_t *server);
+stats_thread_t *stats_thread_register(hs_stats_t *stats);
+int stats_sum(hs_stats_t *stats, int slot, hs_server_stats_t *sum);
+
+static inline stats_thread_t *stats_thread(hs_stats_t *stats)
+{
+    static __thread hs_stats_t *cached_stats;
+    static __thread stats_thread_t *cached_thread;
+
+    // Fast path, thread keeps counting for the same server
+    if (cached_stats != stats)
+    {
+        cached_thread = pthread_getspecific(stats->key);
+        if (cached_thread == NULL)
+            cached_thread = stats_thread_register(stats);
+        cached_stats = stats;
+    }
+
+    return cached_thread;
+}
+
+static inline void stats_add(uint64_t *counter, uint64_t value)
+{
+    // Single writer, relaxed store keeps concurrent readers from tearing
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+static inline void stats_max(uint64_t *counter, uint64_t value)
+{
+    if (value > *counter)
+        __atomic_store_n(counter, value, __ATOMIC_RELAXED);
+}
+
+static inline stats_slot_t *stats_slot(stats_thread_t *thread, int slot)
+{
+    // Only the fallback counters lack slots, subaddresses are registered
+    // before the server runs
+    return &thread->slot[(slot < thread->slots) ? slot : STATS_SLOT_UNASSIGNED];
+}
+
+static inline int stats_type(int type)
+{
+    return ((type >= 0) && (type < HS_STATS_MESSAGE_TYPES - 1)) ? type : HS_STATS_MESSAGE_TYPES - 1;
+}
+
+static inline void stats_message_in(hs_stats_t *stats, int slot, int type, uint64_t length)
+{
+    stats_slot_t *s = stats_slot(stats_thread(stats), slot);
+
+    stats_add(&s->messages_in[stats_type(type)], 1);
+    stats_add(&s->bytes_in[stats_type(type)], length);
+}
+
+static inline void stats_message_out(hs_stats_t *stats, int slot, int type, uint64_t length)
+{
+    stats_slot_t *s = stats_slot(stats_thread(stats), slot);
+
+    stats_add(&s->messages_out[stats_type(type)], 1);
+    stats_add(&s->bytes_out[stats_type(type)], length);
+}
+
+static inline void stats_callback_time(hs_stats_t *stats, int slot, uint64_t ns)
+{
+    stats_slot_t *s = stats_slot(stats_thread(stats), slot);
+    uint64_t us = ns / 1000;
+    int bucket;
+
+    bucket = (us == 0) ? 0 : 64 - __builtin_clzll(us);
+    if (bucket >= HS_STATS_HISTOGRAM_BUCKETS)
+        bucket = HS_STATS_HISTOGRAM_BUCKETS - 1;
+
+    stats_add(&s->callback_time[bucket], 1);
+}
+
+#endif
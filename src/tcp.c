@@ -30,16 +30,27 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <poll.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stddef.h>
+#include <hislip/common.h>
+#include "tcp.h"
 #include "error.h"
 
 typedef struct
@@ -49,6 +60,33 @@ typedef struct
     void *data;
 } connection_data_t;
 
+#define TCP_RESOLVE_CACHE_SIZE 16
+#define TCP_RESOLVE_CACHE_TTL 60 // seconds
+
+typedef struct
+{
+    char host[256];
+    struct sockaddr_in address;
+    time_t expires;
+} tcp_resolve_entry_t;
+
+static tcp_resolve_entry_t tcp_resolve_cache[TCP_RESOLVE_CACHE_SIZE];
+static pthread_mutex_t tcp_resolve_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Name lookup running on a thread of its own, shared by thread and caller
+struct tcp_resolve_t
+{
+    pthread_mutex_t mutex;
+    int fd;
+    char *address;
+    int port;
+    tcp_address_t server_address;
+    int status;
+    int error;
+    bool finished;
+    int refs;
+};
+
 static void print_data(void *data, int length)
 {
     int i;
@@ -68,102 +106,461 @@ static void print_data(void *data, int length)
     }
 }
 
-int tcp_connect(int *sd, char *address, int port, int timeout)
+static int tcp_wait(int sd, short events, int timeout)
 {
-    struct sockaddr_in server_address;
-    struct hostent *host;
+    int status;
+    struct pollfd pfd;
+
+    pfd.fd = sd;
+    pfd.events = events;
+
+    // Wait for socket to become ready (a timeout of 0 means wait forever)
+    do
+        status = poll(&pfd, 1, timeout ? timeout : -1);
+    while ((status == -1) && (errno == EINTR));
 
-    // Create a TCP/IP stream socket
-    if ((*sd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+    if (status == 0)
     {
-        error_printf("socket() call failed\n");
+        error_printf("Timeout\n");
+        errno = ETIMEDOUT;
         return -1;
     }
 
-    // Construct the server address structure
-    memset(&server_address, 0, sizeof(server_address));
-    server_address.sin_family      = AF_INET;
-    server_address.sin_port        = htons(port);
-    server_address.sin_addr.s_addr = inet_addr(address);
+    return status;
+}
+
+/*
+ * tcp_loopback_address() - Address of local transport endpoint
+ *
+ * Local transport uses Unix domain sockets in the abstract namespace, named
+ * after the port, so the protocol stack can be exercised without TCP.
+ *
+ */
+
+static void tcp_loopback_address(int port, tcp_address_t *server_address)
+{
+    struct sockaddr_un *address = (struct sockaddr_un *) &server_address->address;
+    int length;
+
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    length = snprintf(address->sun_path + 1, sizeof(address->sun_path) - 1, "libhislip-%d", port);
+    server_address->length = offsetof(struct sockaddr_un, sun_path) + 1 + length;
+}
+
+/*
+ * tcp_resolve() - Resolve host address
+ *
+ * Looks up IPv4 address of host name or dotted address using getaddrinfo().
+ * Results are cached for a while since instrument fleets are typically
+ * connected by name over and over again. HS_LOOPBACK_ADDRESS resolves to
+ * the local transport.
+ *
+ */
+
+static int tcp_resolve_cached(char *address, int port, tcp_address_t *server_address)
+{
+    struct sockaddr_in *inet_address = (struct sockaddr_in *) &server_address->address;
+    time_t now = time(NULL);
+    int i;
 
-    if (server_address.sin_addr.s_addr == (unsigned long) INADDR_NONE)
+    if (strcmp(address, HS_LOOPBACK_ADDRESS) == 0)
     {
-        // Look up host address
-        host = gethostbyname(address);
+        tcp_loopback_address(port, server_address);
+        return 0;
+    }
+
+    server_address->length = sizeof(struct sockaddr_in);
 
-        if (host == (struct hostent *) NULL)
+    pthread_mutex_lock(&tcp_resolve_mutex);
+
+    for (i=0; i<TCP_RESOLVE_CACHE_SIZE; i++)
+    {
+        if ((tcp_resolve_cache[i].expires > now) &&
+            (strcmp(tcp_resolve_cache[i].host, address) == 0))
         {
-            error_printf("Host not found\n");
-            close(*sd);
-            return -1;
+            *inet_address = tcp_resolve_cache[i].address;
+            pthread_mutex_unlock(&tcp_resolve_mutex);
+            inet_address->sin_port = htons(port);
+            return 0;
         }
+    }
+
+    pthread_mutex_unlock(&tcp_resolve_mutex);
+
+    return -1;
+}
+
+int tcp_resolve(char *address, int port, tcp_address_t *server_address)
+{
+    struct sockaddr_in *inet_address = (struct sockaddr_in *) &server_address->address;
+    struct addrinfo hints, *result;
+    tcp_resolve_entry_t *entry = NULL;
+    time_t now = time(NULL);
+    int i, status;
+
+    if (tcp_resolve_cached(address, port, server_address) == 0)
+        return 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    status = getaddrinfo(address, NULL, &hints, &result);
+    if (status != 0)
+    {
+        error_printf("Host %s not found (%s)\n", address, gai_strerror(status));
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    memcpy(inet_address, result->ai_addr, sizeof(*inet_address));
+    freeaddrinfo(result);
+
+    // Replace entry expiring first
+    if (strlen(address) < sizeof(entry->host))
+    {
+        pthread_mutex_lock(&tcp_resolve_mutex);
+
+        for (i=0; i<TCP_RESOLVE_CACHE_SIZE; i++)
+        {
+            if ((entry == NULL) || (tcp_resolve_cache[i].expires < entry->expires))
+                entry = &tcp_resolve_cache[i];
+        }
+
+        strcpy(entry->host, address);
+        entry->address = *inet_address;
+        entry->expires = now + TCP_RESOLVE_CACHE_TTL;
+
+        pthread_mutex_unlock(&tcp_resolve_mutex);
+    }
+
+    inet_address->sin_port = htons(port);
+
+    return 0;
+}
+
+static void tcp_resolve_put(tcp_resolve_t *resolve)
+{
+    if (--resolve->refs > 0)
+    {
+        pthread_mutex_unlock(&resolve->mutex);
+        return;
+    }
+
+    pthread_mutex_unlock(&resolve->mutex);
+    pthread_mutex_destroy(&resolve->mutex);
+    close(resolve->fd);
+    free(resolve->address);
+    free(resolve);
+}
+
+static void tcp_resolve_done(tcp_resolve_t *resolve, int status)
+{
+    uint64_t value = 1;
+
+    resolve->status = status;
+    resolve->error = errno;
+    resolve->finished = true;
+
+    // Wake up poller
+    if (write(resolve->fd, &value, sizeof(value)) < 0)
+        error_printf("write() failed\n");
+}
+
+static void *tcp_resolve_thread(void *arg)
+{
+    tcp_resolve_t *resolve = arg;
+    tcp_address_t server_address;
+    int status;
+
+    status = tcp_resolve(resolve->address, resolve->port, &server_address);
+
+    pthread_mutex_lock(&resolve->mutex);
+    resolve->server_address = server_address;
+    tcp_resolve_done(resolve, status);
+    tcp_resolve_put(resolve);
+
+    return NULL;
+}
+
+/*
+ * tcp_resolve_start() - Start resolving host address
+ *
+ * Looks up address like tcp_resolve() on a thread of its own, so lookups of
+ * several hosts overlap and can be polled for along with sockets. The file
+ * descriptor of tcp_resolve_fd() polls readable once lookup has finished.
+ * Cached and local addresses are resolved at once.
+ *
+ */
+
+tcp_resolve_t *tcp_resolve_start(char *address, int port)
+{
+    tcp_resolve_t *resolve;
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    resolve = calloc(1, sizeof(tcp_resolve_t));
+    if (resolve == NULL)
+    {
+        error_printf("calloc() failed\n");
+        return NULL;
+    }
+
+    resolve->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (resolve->fd < 0)
+    {
+        error_printf("eventfd() failed\n");
+        free(resolve);
+        return NULL;
+    }
+
+    pthread_mutex_init(&resolve->mutex, NULL);
+    resolve->port = port;
+    resolve->refs = 1;
+
+    if (tcp_resolve_cached(address, port, &resolve->server_address) == 0)
+    {
+        tcp_resolve_done(resolve, 0);
+        return resolve;
+    }
+
+    resolve->address = strdup(address);
+    if (resolve->address == NULL)
+    {
+        error_printf("strdup() failed\n");
+        pthread_mutex_lock(&resolve->mutex);
+        tcp_resolve_put(resolve);
+        return NULL;
+    }
+
+    // Thread holds a reference since caller may give up on lookup
+    resolve->refs++;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, tcp_resolve_thread, resolve) != 0)
+    {
+        // Fall back to looking up in caller
+        resolve->refs--;
+        tcp_resolve_done(resolve, tcp_resolve(address, port, &resolve->server_address));
+    }
+    pthread_attr_destroy(&attr);
+
+    return resolve;
+}
+
+int tcp_resolve_fd(tcp_resolve_t *resolve)
+{
+    return resolve->fd;
+}
+
+/*
+ * tcp_resolve_finish() - Collect resolved host address
+ *
+ * Releases lookup started by tcp_resolve_start() and returns its result.
+ * Fails with errno ETIMEDOUT if lookup has not finished yet, in which case
+ * it is abandoned.
+ *
+ */
+
+int tcp_resolve_finish(tcp_resolve_t *resolve, tcp_address_t *server_address)
+{
+    int status;
+
+    pthread_mutex_lock(&resolve->mutex);
+
+    if (!resolve->finished)
+    {
+        status = -1;
+        errno = ETIMEDOUT;
+    }
+    else
+    {
+        *server_address = resolve->server_address;
+        status = resolve->status;
+        if (status != 0)
+            errno = resolve->error;
+    }
+
+    tcp_resolve_put(resolve);
+
+    return status;
+}
+
+/*
+ * tcp_connect_start() - Start connecting to server
+ *
+ * Initiates a non-blocking connect. Once the socket polls writable the
+ * outcome is collected with tcp_connect_finish().
+ *
+ */
 
-        memcpy(&server_address.sin_addr, host->h_addr, sizeof(server_address.sin_addr));
+int tcp_connect_start(int *sd, tcp_address_t *server_address)
+{
+    // Create a stream socket of address family
+    if ((*sd = socket(server_address->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+    {
+        error_printf("socket() call failed\n");
+        return -1;
     }
 
     // Establish connection to server
-    if (connect(*sd, (struct sockaddr *) &server_address, sizeof(server_address)) < 0)
+    if ((connect(*sd, (struct sockaddr *) &server_address->address, server_address->length) < 0) &&
+        (errno != EINPROGRESS))
     {
         error_printf("connect() call failed\n");
         close(*sd);
+        *sd = -1;
         return -1;
     }
 
     return 0;
 }
 
-int tcp_write(int sd, void *buffer, int length, int timeout)
+/*
+ * tcp_connect_finish() - Complete connect started by tcp_connect_start()
+ *
+ * Reports connect result and returns socket to blocking mode.
+ *
+ */
+
+int tcp_connect_finish(int sd)
 {
-    int status;
-    struct timeval tv;
-    fd_set wdfs;
+    socklen_t length = sizeof(int);
+    int error = 0, flag = 1;
+
+    if ((getsockopt(sd, SOL_SOCKET, SO_ERROR, &error, &length) < 0) || (error != 0))
+    {
+        errno = error ? error : errno;
+        error_printf("connect() failed (%s)\n", strerror(errno));
+        return -1;
+    }
 
-    // Set timeout
-    tv.tv_sec = 0;
-    tv.tv_usec = timeout * 1000;
+    fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) & ~O_NONBLOCK);
 
-    FD_ZERO(&wdfs);
-    FD_SET(sd, &wdfs);
+    // Not applicable to local transport, so failure is fine
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
 
-    if (timeout)
-        status = select(sd + 1, NULL, &wdfs, NULL, &tv);
-    else
-        status = select(sd + 1, NULL, &wdfs, NULL, NULL);
-    if (status == -1)
+    return 0;
+}
+
+int tcp_connect(int *sd, char *address, int port, int timeout)
+{
+    tcp_address_t server_address;
+
+    if (tcp_resolve(address, port, &server_address) != 0)
         return -1;
-    else if (status)
-        return write(sd, buffer, length); // TODO: Write until exact length done
-    else
-        error_printf("Timeout\n");
 
-    return -1;
+    if (tcp_connect_start(sd, &server_address) != 0)
+        return -1;
+
+    // Wait for connection to complete
+    if ((tcp_wait(*sd, POLLOUT, timeout) < 0) || (tcp_connect_finish(*sd) != 0))
+    {
+        close(*sd);
+        return -1;
+    }
+
+    return 0;
 }
 
-int tcp_read(int sd, void *buffer, int length, int timeout)
+int tcp_write(int sd, void *buffer, int length, int timeout)
 {
-    int status;
-    struct timeval tv;
-    fd_set rdfs;
+    struct iovec iov;
 
-    // Set timeout
-    tv.tv_sec = 0;
-    tv.tv_usec = timeout * 1000;
+    iov.iov_base = buffer;
+    iov.iov_len = length;
 
-    FD_ZERO(&rdfs);
-    FD_SET(sd, &rdfs);
+    return tcp_writev(sd, &iov, 1, timeout);
+}
 
-    if (timeout)
-        status = select(sd + 1, &rdfs, NULL, NULL, &tv);
-    else
-        status = select(sd + 1, &rdfs, NULL, NULL, NULL);
-    if (status == -1)
+/*
+ * tcp_writev() - Write vector of buffers to socket
+ *
+ * Writes all buffers using as few sendmsg() calls as possible. The socket is
+ * only polled when it can not take more data, in which case timeout applies
+ * as for tcp_read(). Note: The iov array is modified while sending.
+ *
+ */
+
+int tcp_writev(int sd, struct iovec *iov, int iovcnt, int timeout)
+{
+    struct msghdr msg;
+    ssize_t status;
+    int bytes_sent = 0;
+
+    memset(&msg, 0, sizeof(msg));
+
+    while (iovcnt > 0)
+    {
+        // Skip empty buffers
+        if (iov->iov_len == 0)
+        {
+            iov++;
+            iovcnt--;
+            continue;
+        }
+
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (iovcnt > UIO_MAXIOV) ? UIO_MAXIOV : iovcnt;
+
+        status = sendmsg(sd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (status < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+                return -1;
+
+            // Wait until socket can take more data
+            if (tcp_wait(sd, POLLOUT, timeout) < 0)
+                return -1;
+            continue;
+        }
+
+        bytes_sent += status;
+
+        // Advance past buffers sent
+        while ((iovcnt > 0) && ((size_t) status >= iov->iov_len))
+        {
+            status -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + status;
+            iov->iov_len -= status;
+        }
+    }
+
+    return bytes_sent;
+}
+
+/*
+ * tcp_read() - Read from socket
+ *
+ * Reads up to length bytes. A positive timeout waits at most timeout ms for
+ * data, a timeout of 0 waits forever and a negative timeout performs a single
+ * non-blocking read which fails with EAGAIN if no data is available (used by
+ * the event loop).
+ *
+ */
+
+int tcp_read(int sd, void *buffer, int length, int timeout)
+{
+    // Non-blocking read
+    if (timeout < 0)
+        return recv(sd, buffer, length, MSG_DONTWAIT);
+
+    // Blocking read
+    if (timeout == 0)
+        return recv(sd, buffer, length, 0);
+
+    if (tcp_wait(sd, POLLIN, timeout) < 0)
         return -1;
-    else if (status)
-        return read(sd, buffer, length); // TODO: Read until exact length done
-    else
-        error_printf("Timeout\n");
 
-    return -1;
+    return recv(sd, buffer, length, 0);
 }
 
 int tcp_disconnect(int sd)
@@ -176,46 +573,65 @@ static void *connection_thread(void *arg)
     // Call connection callback
     connection_data_t *connection_data = arg;
     connection_data->connection_callback(connection_data->sd, connection_data->data);
+    free(connection_data);
 
     return 0;
 }
 
 /*
- * tcp_server_start() - Start TCP server
+ * tcp_listen() - Create listening socket
  *
- * This will start a TCP server that listens for any incoming connections on
- * provided port. For each new incoming connection a callback is called in a
- * separate thread.
+ * Returns a socket bound to provided port which accepts up to n pending
+ * connections, or -1 on failure. With TCP_LISTEN_REUSEPORT several sockets
+ * can listen on the same port and the kernel spreads incoming connections
+ * over them. With TCP_LISTEN_LOOPBACK the socket listens on the local
+ * transport instead of TCP.
  *
  */
 
-int tcp_server_start(int port, int n, void (*connection_callback)(int sd, void *data), void *data)
+int tcp_listen(int port, int n, int flags)
 {
     int server_socket;
     int status;
-    struct sockaddr_in server_address;
-    struct sockaddr_in client_address;
-    connection_data_t connection_data;
+    int enable = 1;
+    tcp_address_t server_address;
 
-    // Create a reliable stream socket using TCP/IP
-    if ((server_socket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+    if (flags & TCP_LISTEN_LOOPBACK)
+        tcp_loopback_address(port, &server_address);
+    else
+    {
+        struct sockaddr_in *address = (struct sockaddr_in *) &server_address.address;
+
+        memset(address, 0, sizeof(*address));
+        address->sin_family = AF_INET;
+        address->sin_port = htons(port);
+        address->sin_addr.s_addr = htonl(INADDR_ANY);
+        server_address.length = sizeof(*address);
+    }
+
+    // Create a reliable stream socket
+    if ((server_socket = socket(server_address.address.ss_family, SOCK_STREAM, 0)) < 0)
     {
         error_printf("socket() call failed (%s)\n", strerror(errno));
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
-    // Initialize server address structure
-    memset(&server_address, 0, sizeof(server_address));
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(port);
-    server_address.sin_addr.s_addr = htonl(INADDR_ANY);
+    // Allow quick server restarts
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+    if ((flags & TCP_LISTEN_REUSEPORT) && (setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0))
+    {
+        error_printf("setsockopt() call failed (%s)\n", strerror(errno));
+        close(server_socket);
+        return -1;
+    }
 
     // Assign server address to socket
-    if ((status = bind(server_socket, (struct sockaddr *) &server_address, sizeof(server_address))) < 0)
+    if ((status = bind(server_socket, (struct sockaddr *) &server_address.address, server_address.length)) < 0)
     {
         error_printf("bind() call failed (%s)\n", strerror(errno));
         close(server_socket);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     // Allow up to N clients to be connected simultaneously
@@ -223,16 +639,39 @@ int tcp_server_start(int port, int n, void (*connection_callback)(int sd, void *
     {
         error_printf("listen() call failed (%s)\n", strerror(errno));
         close(server_socket);
-        exit (EXIT_FAILURE);
+        return -1;
     }
 
     printf("Listening for incoming client connections on port %d\n", port);
 
+    return server_socket;
+}
+
+/*
+ * tcp_server_start() - Start TCP server
+ *
+ * This will start a TCP server that listens for any incoming connections on
+ * provided port. For each new incoming connection a callback is called in a
+ * separate thread.
+ *
+ */
+
+int tcp_server_start(int port, int n, void (*connection_callback)(int sd, void *data), void *data)
+{
+    int server_socket;
+    struct sockaddr_in client_address;
+    connection_data_t *connection_data;
+
+    // Create listening socket
+    if ((server_socket = tcp_listen(port, n, 0)) < 0)
+        exit(EXIT_FAILURE);
+
     // Enter service loop
     while (1)
     {
         pthread_t thread;
         int client_socket;
+        int enable = 1;
 
         // Wait for and accept incoming connection
         socklen_t sin_size = sizeof(struct sockaddr_in);
@@ -245,13 +684,29 @@ int tcp_server_start(int port, int n, void (*connection_callback)(int sd, void *
 
         printf("Incoming connection from client (%s)\n", inet_ntoa(client_address.sin_addr));
 
-        // Prepare connection data
-        connection_data.sd = client_socket;
-        connection_data.data = data;
-        connection_data.connection_callback = connection_callback;
+        // Disable Nagle so small responses are not delayed
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+        // Prepare connection data (owned by connection thread)
+        connection_data = malloc(sizeof(connection_data_t));
+        if (connection_data == NULL)
+        {
+            error_printf("malloc() failed\n");
+            close(client_socket);
+            continue;
+        }
+        connection_data->sd = client_socket;
+        connection_data->data = data;
+        connection_data->connection_callback = connection_callback;
 
         // Create connection thread
-        pthread_create(&thread, NULL, connection_thread, &connection_data);
+        if (pthread_create(&thread, NULL, connection_thread, connection_data) != 0)
+        {
+            error_printf("pthread_create() failed\n");
+            close(client_socket);
+            free(connection_data);
+            continue;
+        }
 
         // Make sure connection thread does its own cleanup upon termination
         pthread_detach(thread);
@@ -31,16 +31,39 @@
 #ifndef TCP_H
 #define TCP_H
 
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <stdbool.h>
+
+#define TCP_LISTEN_REUSEPORT 0x1
+#define TCP_LISTEN_LOOPBACK  0x2
+
+typedef struct
+{
+    struct sockaddr_storage address;
+    socklen_t length;
+} tcp_address_t;
+
+typedef struct tcp_resolve_t tcp_resolve_t;
+
 // Client API
 int tcp_connect(int *sd, char *address, int port, int timeout);
+int tcp_resolve(char *address, int port, tcp_address_t *server_address);
+tcp_resolve_t *tcp_resolve_start(char *address, int port);
+int tcp_resolve_fd(tcp_resolve_t *resolve);
+int tcp_resolve_finish(tcp_resolve_t *resolve, tcp_address_t *server_address);
+int tcp_connect_start(int *sd, tcp_address_t *server_address);
+int tcp_connect_finish(int sd);
 int tcp_disconnect(int sd);
 
 // Server API
+int tcp_listen(int port, int n, int flags);
 int tcp_server_start(int port, int n, void (*connection_callback)(int sd, void *data), void *data);
 int tcp_server_stop(void);
 
 // Common API
 int tcp_write(int sd, void *buffer, int length, int timeout);
+int tcp_writev(int sd, struct iovec *iov, int iovcnt, int timeout);
 int tcp_read(int sd, void *buffer, int length, int timeout);
 
 #endif
@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2017  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <hislip/server.h>
+#include "trace.h"
+#include "error.h"
+
+#ifdef ENABLE_TRACE
+
+// Single producer (owning thread), single consumer (drainer) ring. Producer
+// and consumer positions live on cache lines of their own.
+typedef struct trace_ring_t
+{
+    struct trace_ring_t *next;
+    uint64_t head __attribute__((aligned(TRACE_CACHE_LINE_SIZE)));
+    uint64_t dropped;
+    uint64_t tail __attribute__((aligned(TRACE_CACHE_LINE_SIZE)));
+    hs_trace_record_t record[TRACE_RING_SIZE] __attribute__((aligned(TRACE_CACHE_LINE_SIZE)));
+} trace_ring_t;
+
+bool trace_enabled = false;
+
+static __thread trace_ring_t *trace_ring;
+static trace_ring_t *trace_rings;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static trace_ring_t *trace_ring_create(void)
+{
+    trace_ring_t *ring;
+
+    if (posix_memalign((void **) &ring, TRACE_CACHE_LINE_SIZE, sizeof(trace_ring_t)) != 0)
+        return NULL;
+    memset(ring, 0, sizeof(trace_ring_t));
+
+    // Rings outlive their threads so no record is lost
+    pthread_mutex_lock(&trace_mutex);
+    ring->next = trace_rings;
+    trace_rings = ring;
+    pthread_mutex_unlock(&trace_mutex);
+
+    return ring;
+}
+
+/*
+ * trace_record() - Record message pipeline stage
+ *
+ * Appends a timestamped record to the ring of the calling thread without
+ * taking any lock. Records are dropped (and counted) while the ring is
+ * full.
+ *
+ */
+
+void trace_record(hs_trace_stage_t stage, uint16_t session_id, uint32_t message_id, uint8_t type)
+{
+    trace_ring_t *ring = trace_ring;
+    hs_trace_record_t *record;
+    struct timespec ts;
+    uint64_t head;
+
+    if (ring == NULL)
+    {
+        ring = trace_ring_create();
+        if (ring == NULL)
+            return;
+        trace_ring = ring;
+    }
+
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= TRACE_RING_SIZE)
+    {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    record = &ring->record[head & (TRACE_RING_SIZE - 1)];
+    record->timestamp = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    record->message_id = message_id;
+    record->session_id = session_id;
+    record->type = type;
+    record->stage = stage;
+
+    // Publish record to consumer
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int hs_trace_enable(bool enable)
+{
+    __atomic_store_n(&trace_enabled, enable, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/*
+ * hs_trace_drain() - Take recorded trace records
+ *
+ * Moves up to count records out of the per-thread rings into records and
+ * returns the number of records taken. Records of one thread are in time
+ * order, records of different threads are not merged.
+ *
+ */
+
+int hs_trace_drain(hs_trace_record_t *records, int count)
+{
+    trace_ring_t *ring;
+    uint64_t head, tail;
+    int n = 0;
+
+    pthread_mutex_lock(&trace_mutex);
+
+    for (ring=trace_rings; (ring != NULL) && (n < count); ring=ring->next)
+    {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (tail=ring->tail; (tail != head) && (n < count); tail++)
+            records[n++] = ring->record[tail & (TRACE_RING_SIZE - 1)];
+
+        // Hand slots back to producer
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&trace_mutex);
+
+    return n;
+}
+
+/*
+ * hs_trace_dump() - Write recorded trace records to file
+ *
+ * Drains all rings into a binary trace file consisting of a
+ * hs_trace_file_header_t followed by hs_trace_record_t records. Returns the
+ * number of records written.
+ *
+ */
+
+int hs_trace_dump(const char *filename)
+{
+    hs_trace_file_header_t header;
+    hs_trace_record_t records[256];
+    FILE *file;
+    int n, total = 0;
+
+    file = fopen(filename, "wb");
+    if (file == NULL)
+    {
+        error_printf("Could not open %s (%s)\n", filename, strerror(errno));
+        return -1;
+    }
+
+    header.magic = HS_TRACE_FILE_MAGIC;
+    header.version = HS_TRACE_FILE_VERSION;
+    header.record_size = sizeof(hs_trace_record_t);
+    if (fwrite(&header, sizeof(header), 1, file) != 1)
+        goto error;
+
+    while ((n = hs_trace_drain(records, 256)) > 0)
+    {
+        if (fwrite(records, sizeof(hs_trace_record_t), n, file) != (size_t) n)
+            goto error;
+        total += n;
+    }
+
+    if (fclose(file) != 0)
+    {
+        error_printf("Could not write %s\n", filename);
+        return -1;
+    }
+
+    return total;
+
+error:
+    error_printf("Could not write %s\n", filename);
+    fclose(file);
+    return -1;
+}
+
+uint64_t hs_trace_dropped(void)
+{
+    trace_ring_t *ring;
+    uint64_t dropped = 0;
+
+    pthread_mutex_lock(&trace_mutex);
+    for (ring=trace_rings; ring != NULL; ring=ring->next)
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&trace_mutex);
+
+    return dropped;
+}
+
+#else
+
+int hs_trace_enable(bool enable)
+{
+    if (enable)
+    {
+        error_printf("Tracing not compiled in\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int hs_trace_drain(hs_trace_record_t *records, int count)
+{
+    return 0;
+}
+
+int hs_trace_dump(const char *filename)
+{
+    error_printf("Tracing not compiled in\n");
+    return -1;
+}
+
+uint64_t hs_trace_dropped(void)
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,788 @@
+/*
+ * Copyright (c) 2017  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include "config.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include "uring.h"
+#include "tcp.h"
+#include "error.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 256
+#define URING_BUFFERS 64 // Power of 2
+#define URING_BUFFER_SIZE 0x4000 // 16 KB
+#define URING_BUFFER_GROUP 0
+
+// Completion tags besides connection handles
+#define URING_ACCEPT 0
+#define URING_CANCEL 1
+#define URING_WAKE 2
+
+typedef struct uring_loop_t uring_loop_t;
+
+typedef struct uring_handle_t
+{
+    reactor_source_t source;
+    uring_loop_t *loop;
+    int socket;
+    void *context;
+    bool closed;
+    bool detached;
+    bool armed; // Multishot receive outstanding
+
+    // Input arriving while paused, handed over on resume
+    bool paused;
+    bool hangup;
+    char *pending;
+    size_t pending_length;
+    struct uring_handle_t *next; // Resumed handles
+} uring_handle_t;
+
+struct uring_loop_t
+{
+    int fd;
+
+    // Submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_tail_local;
+    struct io_uring_sqe *sqes;
+
+    // Completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Provided receive buffers
+    struct io_uring_buf_ring *buf_ring;
+    unsigned short buf_tail;
+    char *buffers;
+
+    int listen_socket;
+    reactor_callbacks_t *callbacks;
+    void *data;
+
+    // Paused connections to resume, signalled through wake_fd
+    pthread_mutex_t mutex;
+    uring_handle_t *resumed;
+    int wake_fd;
+    uint64_t wake_value;
+};
+
+// Received data being handed to connection by uring_read()
+static __thread struct
+{
+    int socket;
+    char *data;
+    size_t length;
+} uring_input = { -1, NULL, 0 };
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int uring_wake_init(uring_loop_t *u);
+
+/*
+ * uring_init() - Create ring and provided buffers for event loop
+ *
+ * Must run in the thread using the ring since the ring is created for a
+ * single issuer.
+ *
+ */
+
+static int uring_init(uring_loop_t *u)
+{
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    size_t sq_size, cq_size;
+    void *sq, *cq;
+    unsigned i;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+
+    u->fd = uring_setup(URING_ENTRIES, &params);
+    if ((u->fd < 0) && (errno == EINVAL))
+    {
+        // Older kernel, retry without optional flags
+        memset(&params, 0, sizeof(params));
+        u->fd = uring_setup(URING_ENTRIES, &params);
+    }
+    if (u->fd < 0)
+    {
+        error_printf("io_uring_setup() failed (%s)\n", strerror(errno));
+        return -1;
+    }
+
+    // Map rings, in one go if kernel supports it
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sq_size = cq_size = (sq_size > cq_size) ? sq_size : cq_size;
+
+    sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        goto error_mmap;
+
+    cq = sq;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+            goto error_mmap;
+    }
+
+    u->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+        goto error_mmap;
+
+    u->sq_head = (unsigned *) ((char *) sq + params.sq_off.head);
+    u->sq_tail = (unsigned *) ((char *) sq + params.sq_off.tail);
+    u->sq_mask = *(unsigned *) ((char *) sq + params.sq_off.ring_mask);
+    u->sq_entries = params.sq_entries;
+    u->sq_tail_local = *u->sq_tail;
+    u->cq_head = (unsigned *) ((char *) cq + params.cq_off.head);
+    u->cq_tail = (unsigned *) ((char *) cq + params.cq_off.tail);
+    u->cq_mask = *(unsigned *) ((char *) cq + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) ((char *) cq + params.cq_off.cqes);
+
+    // Submission queue entries map one to one
+    for (i=0; i<params.sq_entries; i++)
+        ((unsigned *) ((char *) sq + params.sq_off.array))[i] = i;
+
+    // Register ring of buffers kernel picks from when data arrives
+    u->buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u->buffers = malloc(URING_BUFFERS * URING_BUFFER_SIZE);
+    if ((u->buf_ring == MAP_FAILED) || (u->buffers == NULL))
+        goto error_mmap;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) u->buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        error_printf("io_uring_register() failed (%s)\n", strerror(errno));
+        close(u->fd);
+        return -1;
+    }
+
+    u->buf_tail = 0;
+    for (i=0; i<URING_BUFFERS; i++)
+    {
+        u->buf_ring->bufs[i].addr = (uint64_t) (uintptr_t) (u->buffers + i * URING_BUFFER_SIZE);
+        u->buf_ring->bufs[i].len = URING_BUFFER_SIZE;
+        u->buf_ring->bufs[i].bid = i;
+    }
+    u->buf_tail = URING_BUFFERS;
+    __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+
+    if (uring_wake_init(u) != 0)
+    {
+        close(u->fd);
+        return -1;
+    }
+
+    return 0;
+
+error_mmap:
+    error_printf("mmap() failed (%s)\n", strerror(errno));
+    close(u->fd);
+    return -1;
+}
+
+static void uring_buffer_recycle(uring_loop_t *u, unsigned bid)
+{
+    struct io_uring_buf *buf = &u->buf_ring->bufs[u->buf_tail & (URING_BUFFERS - 1)];
+
+    buf->addr = (uint64_t) (uintptr_t) (u->buffers + bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&u->buf_ring->tail, ++u->buf_tail, __ATOMIC_RELEASE);
+}
+
+static unsigned uring_pending(uring_loop_t *u)
+{
+    return u->sq_tail_local - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static int uring_submit(uring_loop_t *u, unsigned wait)
+{
+    int status;
+
+    __atomic_store_n(u->sq_tail, u->sq_tail_local, __ATOMIC_RELEASE);
+
+    // One system call submits everything queued and waits for completions
+    do
+        status = uring_enter(u->fd, uring_pending(u), wait, wait ? IORING_ENTER_GETEVENTS : 0);
+    while ((status < 0) && (errno == EINTR));
+
+    return status;
+}
+
+static struct io_uring_sqe *uring_sqe(uring_loop_t *u)
+{
+    struct io_uring_sqe *sqe;
+
+    // Flush queue if full
+    if ((uring_pending(u) >= u->sq_entries) && (uring_submit(u, 0) < 0))
+        return NULL;
+
+    sqe = &u->sqes[u->sq_tail_local & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_tail_local++;
+
+    return sqe;
+}
+
+static void uring_accept(uring_loop_t *u)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u);
+
+    if (sqe == NULL)
+        return;
+
+    // Multishot accept keeps delivering connections from one request
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = u->listen_socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = URING_ACCEPT;
+}
+
+static void uring_receive(uring_loop_t *u, uring_handle_t *handle)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u);
+
+    if (sqe == NULL)
+        return;
+
+    // Multishot receive into buffers picked by kernel from buffer ring
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = handle->socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = (uint64_t) (uintptr_t) handle;
+    handle->armed = true;
+}
+
+static void uring_cancel(uring_loop_t *u, uring_handle_t *handle)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u);
+
+    if (sqe == NULL)
+        return;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t) (uintptr_t) handle;
+    sqe->user_data = URING_CANCEL;
+}
+
+static void uring_wake_arm(uring_loop_t *u)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u);
+
+    if (sqe == NULL)
+        return;
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = u->wake_fd;
+    sqe->addr = (uint64_t) (uintptr_t) &u->wake_value;
+    sqe->len = sizeof(u->wake_value);
+    sqe->user_data = URING_WAKE;
+}
+
+static int uring_wake_init(uring_loop_t *u)
+{
+    pthread_mutex_init(&u->mutex, NULL);
+    u->resumed = NULL;
+
+    u->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (u->wake_fd < 0)
+    {
+        error_printf("eventfd() call failed (%s)\n", strerror(errno));
+        return -1;
+    }
+
+    uring_wake_arm(u);
+
+    return 0;
+}
+
+static void uring_resume(reactor_source_t *source)
+{
+    uring_handle_t *handle = (uring_handle_t *) source;
+    uring_loop_t *u = handle->loop;
+    uint64_t value = 1;
+
+    pthread_mutex_lock(&u->mutex);
+    handle->next = u->resumed;
+    u->resumed = handle;
+    pthread_mutex_unlock(&u->mutex);
+
+    if (write(u->wake_fd, &value, sizeof(value)) < 0)
+        error_printf("write() call failed (%s)\n", strerror(errno));
+}
+
+static void uring_hold(uring_handle_t *handle, char *data, size_t length)
+{
+    char *pending;
+
+    pending = realloc(handle->pending, handle->pending_length + length);
+    if (pending == NULL)
+    {
+        // Connection is closed on resume, resume may already be under way
+        error_printf("realloc() failed\n");
+        handle->hangup = true;
+        return;
+    }
+
+    memcpy(pending + handle->pending_length, data, length);
+    handle->pending = pending;
+    handle->pending_length += length;
+}
+
+static int uring_deliver(uring_loop_t *u, uring_handle_t *handle, char *data, size_t length)
+{
+    int status;
+
+    // Let connection consume data through uring_read()
+    uring_input.socket = handle->socket;
+    uring_input.data = data;
+    uring_input.length = length;
+    status = u->callbacks->input(handle->context);
+
+    // Paused connection leaves rest of data for later
+    if ((status == REACTOR_PAUSE) && (uring_input.length > 0))
+        uring_hold(handle, uring_input.data, uring_input.length);
+
+    uring_input.socket = -1;
+
+    return status;
+}
+
+static void uring_status(uring_loop_t *u, uring_handle_t *handle, int status)
+{
+    if (status < 0)
+    {
+        handle->closed = true;
+        u->callbacks->close(handle->context);
+        if (handle->armed)
+            uring_cancel(u, handle);
+    }
+    else if (status == REACTOR_DETACH)
+    {
+        // Hand over once receive is no longer armed
+        handle->closed = true;
+        handle->detached = true;
+        if (handle->armed)
+            uring_cancel(u, handle);
+    }
+    else if (status == REACTOR_PAUSE)
+    {
+        // Receive is re-armed on resume
+        handle->paused = true;
+        if (handle->armed)
+            uring_cancel(u, handle);
+    }
+    else if (!handle->armed)
+        uring_receive(u, handle);
+}
+
+static void uring_release(uring_loop_t *u, uring_handle_t *handle)
+{
+    // Handle is gone once receive is no longer armed
+    if (handle->closed && !handle->armed)
+    {
+        if (handle->detached)
+            u->callbacks->detach(handle->context);
+        free(handle->pending);
+        free(handle);
+    }
+}
+
+static void uring_wake(uring_loop_t *u)
+{
+    uring_handle_t *handle, *next;
+    char *data;
+    size_t length;
+    int status;
+
+    pthread_mutex_lock(&u->mutex);
+    handle = u->resumed;
+    u->resumed = NULL;
+    pthread_mutex_unlock(&u->mutex);
+
+    uring_wake_arm(u);
+
+    for (; handle != NULL; handle = next)
+    {
+        next = handle->next;
+
+        // Hand over input held back while paused, connection may pause again
+        data = handle->pending;
+        length = handle->pending_length;
+        handle->pending = NULL;
+        handle->pending_length = 0;
+        handle->paused = false;
+        status = uring_deliver(u, handle, data, length);
+        free(data);
+
+        if ((status == 0) && handle->hangup)
+        {
+            printf("Client closed connection\n");
+            status = -1;
+        }
+
+        uring_status(u, handle, status);
+        uring_release(u, handle);
+    }
+}
+
+static void uring_open(uring_loop_t *u, int client_socket)
+{
+    uring_handle_t *handle;
+    int enable = 1;
+
+    setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    handle = calloc(1, sizeof(uring_handle_t));
+    if (handle == NULL)
+    {
+        error_printf("calloc() failed\n");
+        close(client_socket);
+        return;
+    }
+
+    // Create connection context
+    handle->source.resume = uring_resume;
+    handle->loop = u;
+    handle->socket = client_socket;
+    handle->context = u->callbacks->open(client_socket, u->data, &handle->source);
+    if (handle->context == NULL)
+    {
+        close(client_socket);
+        free(handle);
+        return;
+    }
+
+    uring_receive(u, handle);
+}
+
+static void uring_complete(uring_loop_t *u, struct io_uring_cqe *cqe)
+{
+    uring_handle_t *handle = (uring_handle_t *) (uintptr_t) cqe->user_data;
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    char *data;
+    int status = -1;
+
+    if (cqe->user_data == URING_CANCEL)
+        return;
+
+    if (cqe->user_data == URING_WAKE)
+    {
+        uring_wake(u);
+        return;
+    }
+
+    if (cqe->user_data == URING_ACCEPT)
+    {
+        if (cqe->res >= 0)
+            uring_open(u, cqe->res);
+        else
+            error_printf("accept failed (%s)\n", strerror(-cqe->res));
+        if (!more)
+            uring_accept(u);
+        return;
+    }
+
+    if (!more)
+        handle->armed = false;
+
+    if (!handle->closed)
+    {
+        data = u->buffers + (cqe->flags >> IORING_CQE_BUFFER_SHIFT) * URING_BUFFER_SIZE;
+
+        if (handle->paused)
+        {
+            // Keep input arriving until receive is cancelled
+            if (cqe->res > 0)
+                uring_hold(handle, data, cqe->res);
+            else if ((cqe->res != -ENOBUFS) && (cqe->res != -ECANCELED))
+                handle->hangup = true;
+        }
+        else
+        {
+            if (cqe->res > 0)
+                status = uring_deliver(u, handle, data, cqe->res);
+            else if ((cqe->res == -ENOBUFS) || (cqe->res == -ECANCELED))
+                status = 0;
+            else if (cqe->res == 0)
+                printf("Client closed connection\n");
+
+            uring_status(u, handle, status);
+        }
+    }
+
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+        uring_buffer_recycle(u, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+    uring_release(u, handle);
+}
+
+static void *uring_loop(void *arg)
+{
+    uring_loop_t *u = arg;
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+
+    // Serve this thread's share of connections with epoll instead if its
+    // ring can not be set up (e.g. io_uring limits reached)
+    if (uring_init(u) != 0)
+    {
+        printf("io_uring setup failed, running epoll event loop instead\n");
+        reactor_run(u->listen_socket, u->callbacks, u->data);
+        return NULL;
+    }
+
+    uring_accept(u);
+
+    while (1)
+    {
+        if (uring_submit(u, 1) < 0)
+        {
+            error_printf("io_uring_enter() failed (%s)\n", strerror(errno));
+            break;
+        }
+
+        // Handle all completions
+        head = *u->cq_head;
+        tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            cqe = &u->cqes[head & u->cq_mask];
+            uring_complete(u, cqe);
+            head++;
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+/*
+ * uring_available() - Check if io_uring backend can be used
+ *
+ * Probes for io_uring with provided buffer rings, which may be missing or
+ * disabled (kernel.io_uring_disabled, seccomp) at runtime.
+ *
+ */
+
+bool uring_available(void)
+{
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    void *ring;
+    int fd;
+    bool available;
+
+    memset(&params, 0, sizeof(params));
+    fd = uring_setup(4, &params);
+    if (fd < 0)
+        return false;
+
+    ring = mmap(NULL, sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED)
+    {
+        close(fd);
+        return false;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) ring;
+    reg.ring_entries = 1;
+    available = (uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) == 0);
+
+    close(fd);
+    munmap(ring, sizeof(struct io_uring_buf));
+
+    return available;
+}
+
+/*
+ * uring_read() - Read hook for io_uring backend
+ *
+ * Hands out data the event loop has received into a provided buffer.
+ * Reads outside event loop input callbacks go to the socket.
+ *
+ */
+
+int uring_read(int sd, void *buffer, int length, int timeout)
+{
+    size_t n;
+
+    if ((timeout >= 0) || (sd != uring_input.socket))
+        return tcp_read(sd, buffer, length, timeout);
+
+    if (uring_input.length == 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    n = ((size_t) length < uring_input.length) ? (size_t) length : uring_input.length;
+    memcpy(buffer, uring_input.data, n);
+    uring_input.data += n;
+    uring_input.length -= n;
+
+    return n;
+}
+
+/*
+ * uring_start() - Start io_uring driven TCP server
+ *
+ * Same as reactor_start() but each event loop thread is driven by an
+ * io_uring instance using multishot accept and multishot receive into
+ * provided buffers, so a loop iteration costs one system call no matter
+ * how many connections have input.
+ *
+ */
+
+int uring_start(int port, int n, int listen_flags, int threads, reactor_callbacks_t *callbacks, void *data)
+{
+    uring_loop_t *loops;
+    pthread_t thread;
+    int listen_socket;
+    int i;
+
+    if (threads < 1)
+        threads = 1;
+
+    if ((listen_socket = tcp_listen(port, n, listen_flags)) < 0)
+        return -1;
+
+    // Non-blocking for event loop threads falling back to epoll
+    if (fcntl(listen_socket, F_SETFL, fcntl(listen_socket, F_GETFL) | O_NONBLOCK) < 0)
+    {
+        error_printf("fcntl() call failed (%s)\n", strerror(errno));
+        close(listen_socket);
+        return -1;
+    }
+
+    loops = calloc(threads, sizeof(uring_loop_t));
+    if (loops == NULL)
+    {
+        error_printf("calloc() failed\n");
+        close(listen_socket);
+        return -1;
+    }
+
+    for (i=0; i<threads; i++)
+    {
+        loops[i].listen_socket = listen_socket;
+        loops[i].callbacks = callbacks;
+        loops[i].data = data;
+    }
+
+    // Start additional event loop threads
+    for (i=1; i<threads; i++)
+    {
+        if (pthread_create(&thread, NULL, uring_loop, &loops[i]) != 0)
+        {
+            error_printf("pthread_create() failed\n");
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    printf("Running %d io_uring event loop thread(s)\n", threads);
+
+    // Run first event loop in calling thread
+    uring_loop(&loops[0]);
+
+    return -1;
+}
+
+#else
+
+bool uring_available(void)
+{
+    return false;
+}
+
+int uring_read(int sd, void *buffer, int length, int timeout)
+{
+    return tcp_read(sd, buffer, length, timeout);
+}
+
+int uring_start(int port, int n, int listen_flags, int threads, reactor_callbacks_t *callbacks, void *data)
+{
+    error_printf("io_uring support not compiled in\n");
+    return -1;
+}
+
+#endif
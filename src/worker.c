@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2017  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "worker.h"
+#include "error.h"
+
+static void *worker_thread(void *arg)
+{
+    worker_pool_t *pool = arg;
+    worker_queue_t *queue;
+    worker_job_t *job;
+    worker_waiter_t *waiter, *next;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    while (1)
+    {
+        // Wait for a queue with pending jobs
+        while (pool->head == NULL)
+            pthread_cond_wait(&pool->work_available, &pool->mutex);
+
+        queue = pool->head;
+        pool->head = queue->next;
+        if (pool->head == NULL)
+            pool->tail = NULL;
+
+        // Take next job of queue (queue stays scheduled while it runs)
+        job = queue->head;
+        queue->head = job->next;
+        if (queue->head == NULL)
+            queue->tail = NULL;
+
+        pool->depth--;
+        pthread_cond_signal(&pool->space_available);
+
+        // Let paused producers go on once there is space
+        waiter = NULL;
+        if (pool->depth < pool->depth_max)
+        {
+            waiter = pool->waiters;
+            pool->waiters = NULL;
+        }
+
+        pthread_mutex_unlock(&pool->mutex);
+
+        for (; waiter != NULL; waiter = next)
+        {
+            next = waiter->next;
+            waiter->function(waiter);
+        }
+
+        job->function(job);
+
+        pthread_mutex_lock(&pool->mutex);
+
+        // Reschedule queue behind other ready queues if it has more jobs
+        if (queue->head != NULL)
+        {
+            queue->next = NULL;
+            if (pool->tail != NULL)
+                pool->tail->next = queue;
+            else
+                pool->head = queue;
+            pool->tail = queue;
+        }
+        else
+            queue->scheduled = false;
+
+        // Job may have dropped last reference to queue owner
+        if (queue->done != NULL)
+        {
+            pthread_mutex_unlock(&pool->mutex);
+            queue->done(queue);
+            pthread_mutex_lock(&pool->mutex);
+        }
+    }
+
+    return NULL;
+}
+
+int worker_pool_init(worker_pool_t *pool, int threads, int depth_max)
+{
+    pthread_t thread;
+    int i;
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work_available, NULL);
+    pthread_cond_init(&pool->space_available, NULL);
+    pool->head = NULL;
+    pool->tail = NULL;
+    pool->depth = 0;
+    pool->depth_max = (depth_max > 0) ? depth_max : 1;
+    pool->threads = 0;
+    pool->waiters = NULL;
+    pool->full = 0;
+
+    // Start worker threads
+    for (i=0; i<threads; i++)
+    {
+        if (pthread_create(&thread, NULL, worker_thread, pool) != 0)
+        {
+            error_printf("pthread_create() failed\n");
+            break;
+        }
+        pthread_detach(thread);
+        pool->threads++;
+    }
+
+    if (pool->threads == 0)
+    {
+        error_printf("Could not start any worker threads\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+void worker_queue_init(worker_queue_t *queue, void (*done)(worker_queue_t *queue))
+{
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->scheduled = false;
+    queue->next = NULL;
+    queue->done = done;
+}
+
+/*
+ * worker_submit() - Submit job to worker pool
+ *
+ * Adds job to serial queue and schedules the queue on the worker pool. If
+ * the maximum number of queued jobs is reached the caller blocks until a
+ * worker has taken a job, so a slow consumer pushes back on the producer.
+ *
+ */
+
+static void worker_enqueue(worker_pool_t *pool, worker_queue_t *queue, worker_job_t *job)
+{
+    job->next = NULL;
+    if (queue->tail != NULL)
+        queue->tail->next = job;
+    else
+        queue->head = job;
+    queue->tail = job;
+    pool->depth++;
+
+    // Schedule queue unless already waiting or running
+    if (queue->scheduled == false)
+    {
+        queue->scheduled = true;
+        queue->next = NULL;
+        if (pool->tail != NULL)
+            pool->tail->next = queue;
+        else
+            pool->head = queue;
+        pool->tail = queue;
+        pthread_cond_signal(&pool->work_available);
+    }
+}
+
+int worker_submit(worker_pool_t *pool, worker_queue_t *queue, worker_job_t *job)
+{
+    pthread_mutex_lock(&pool->mutex);
+
+    // Apply backpressure
+    if (pool->depth >= pool->depth_max)
+        __atomic_store_n(&pool->full, pool->full + 1, __ATOMIC_RELAXED);
+    while (pool->depth >= pool->depth_max)
+        pthread_cond_wait(&pool->space_available, &pool->mutex);
+
+    worker_enqueue(pool, queue, job);
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    return 0;
+}
+
+/*
+ * worker_push() - Submit job to worker pool without blocking
+ *
+ * Same as worker_submit() but the job is always queued, for event loops that
+ * must not block. Returns true if this filled the pool, the caller should
+ * then stop producing until waiter is called from a worker thread once
+ * there is space again.
+ *
+ */
+
+bool worker_push(worker_pool_t *pool, worker_queue_t *queue, worker_job_t *job, worker_waiter_t *waiter)
+{
+    bool full = false;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    worker_enqueue(pool, queue, job);
+
+    // Apply backpressure
+    if (pool->depth >= pool->depth_max)
+    {
+        __atomic_store_n(&pool->full, pool->full + 1, __ATOMIC_RELAXED);
+        waiter->next = pool->waiters;
+        pool->waiters = waiter;
+        full = true;
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    return full;
+}
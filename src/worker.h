@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2017  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+typedef struct worker_job_t
+{
+    void (*function)(struct worker_job_t *job);
+    struct worker_job_t *next;
+} worker_job_t;
+
+// Serial queue, jobs submitted to the same queue run one at a time in order
+typedef struct worker_queue_t
+{
+    worker_job_t *head;
+    worker_job_t *tail;
+    bool scheduled;
+    struct worker_queue_t *next;
+
+    // Called after each job once the worker is done with the queue, owner
+    // may free queue from here
+    void (*done)(struct worker_queue_t *queue);
+} worker_queue_t;
+
+// Producer waiting for space in worker pool, see worker_push()
+typedef struct worker_waiter_t
+{
+    void (*function)(struct worker_waiter_t *waiter);
+    struct worker_waiter_t *next;
+} worker_waiter_t;
+
+typedef struct
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t work_available;
+    pthread_cond_t space_available;
+
+    // Queues with pending jobs, ready to be run
+    worker_queue_t *head;
+    worker_queue_t *tail;
+
+    int depth;
+    int depth_max;
+    int threads;
+
+    // Producers to call once depth drops below depth_max
+    worker_waiter_t *waiters;
+
+    // Submissions that had to wait for space
+    uint64_t full;
+} worker_pool_t;
+
+int worker_pool_init(worker_pool_t *pool, int threads, int depth_max);
+void worker_queue_init(worker_queue_t *queue, void (*done)(worker_queue_t *queue));
+int worker_submit(worker_pool_t *pool, worker_queue_t *queue, worker_job_t *job);
+bool worker_push(worker_pool_t *pool, worker_queue_t *queue, worker_job_t *job, worker_waiter_t *waiter);
+
+#endif
@@ -0,0 +1,474 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <hislip/server.h>
+#include <hislip/client.h>
+#include <hislip/common.h>
+
+// End-to-end benchmark of server and client running in one process.
+//
+// Measures round trip latency of small queries while sweeping connection
+// and worker thread counts, bulk throughput in both directions, device
+// clear during a bulk download and connection setup rate, followed by server
+// statistics. Results are written as JSON to stdout, library progress
+// messages are suppressed unless -v is given.
+//
+// Usage: benchmark [-t loopback|tcp] [-n round trips] [-m max bulk size] [-T trace file] [-v]
+
+#define BENCH_PORT_BASE 5880
+#define BENCH_TIMEOUT 30000 // ms
+#define BENCH_CONNECTIONS_MAX 16
+#define BENCH_BULK_BYTES 0x4000000 // Bytes moved per bulk size (64 MB)
+
+static int workers_sweep[] = { 1, 4 };
+static int connections_sweep[] = { 1, 4, 16 };
+
+static char *address = HS_LOOPBACK_ADDRESS;
+static bool loopback = true;
+static int round_trips = 20000;
+static long bulk_size_max = 0x10000000; // 256 MB
+static char *bulk_buffer; // Sent by client on upload and by server on download
+static char *receive_buffer; // Download destination
+static FILE *json;
+static hs_server_t *servers[sizeof(workers_sweep) / sizeof(int)];
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+// Server side
+
+static int bench_message_sync(hs_request_t *request, void *buffer, int length)
+{
+    long size;
+
+    // "SEND <n>" asks for n bytes back, anything else is a small query
+    if ((length > 5) && (strncmp(buffer, "SEND ", 5) == 0))
+    {
+        size = atol((char *) buffer + 5);
+        return hs_send_response(request, bulk_buffer, size);
+    }
+
+    return hs_send_response(request, "OK", 2);
+}
+
+static int bench_message_stream(hs_request_t *request, void *buffer, int length, int flags)
+{
+    static unsigned long long total;
+    char response[32];
+
+    // Count uploaded bytes and report total at end of message
+    if (flags & HS_STREAM_START)
+        total = 0;
+    total += length;
+
+    if (flags & HS_STREAM_END)
+    {
+        snprintf(response, sizeof(response), "%llu", total);
+        return hs_send_response(request, response, strlen(response));
+    }
+
+    return 0;
+}
+
+static void *bench_server_thread(void *arg)
+{
+    hs_server_run(arg);
+
+    return NULL;
+}
+
+static hs_server_t *bench_server_start(int port, int workers)
+{
+    static hs_subaddress_callbacks_t sync_callbacks = { .message_sync = bench_message_sync };
+    static hs_subaddress_callbacks_t stream_callbacks = { .message_stream = bench_message_stream };
+    hs_server_config_t *config;
+    hs_server_t *server;
+    pthread_t thread;
+
+    // Server instances live until process exits
+    server = calloc(1, sizeof(hs_server_t));
+    config = calloc(1, sizeof(hs_server_config_t));
+    if ((server == NULL) || (config == NULL))
+        return NULL;
+
+    hs_server_config_init(config);
+    config->port = port;
+    config->connections_max = 64;
+    config->worker_threads_max = workers;
+    config->worker_queue_depth_max = 64;
+    config->io_mode = HS_IO_EPOLL;
+    config->io_threads_max = 2;
+    config->overlap_mode = true;
+    config->loopback = loopback;
+
+    if (hs_server_init(server, config) != 0)
+        return NULL;
+
+    hs_server_register_subaddress(server, "bench", &sync_callbacks);
+    hs_server_register_subaddress(server, "stream", &stream_callbacks);
+
+    if (pthread_create(&thread, NULL, bench_server_thread, server) != 0)
+        return NULL;
+    pthread_detach(thread);
+
+    // Give server time to start listening
+    usleep(100000);
+
+    return server;
+}
+
+// Server statistics
+
+static void bench_stats(hs_server_t *server, char *subaddress, bool first)
+{
+    hs_server_stats_t stats;
+    uint64_t messages_in = 0, messages_out = 0, bytes_in = 0, bytes_out = 0;
+    int i;
+
+    if (hs_server_get_stats(server, subaddress, &stats) != 0)
+        return;
+
+    for (i=0; i<HS_STATS_MESSAGE_TYPES; i++)
+    {
+        messages_in += stats.messages_in[i];
+        messages_out += stats.messages_out[i];
+        bytes_in += stats.bytes_in[i];
+        bytes_out += stats.bytes_out[i];
+    }
+
+    fprintf(json, "%s\n    { \"subaddress\": \"%s\", \"messages_in\": %llu, \"bytes_in\": %llu, "
+            "\"messages_out\": %llu, \"bytes_out\": %llu, \"queue_full\": %llu, "
+            "\"pool_allocated_max\": %llu, \"pool_leased_max\": %llu, \"callback_time_us\": [",
+            first ? "" : ",", subaddress, (unsigned long long) messages_in, (unsigned long long) bytes_in,
+            (unsigned long long) messages_out, (unsigned long long) bytes_out,
+            (unsigned long long) stats.queue_full, (unsigned long long) stats.pool_allocated_max,
+            (unsigned long long) stats.pool_leased_max);
+
+    // Histogram buckets as powers of two of microseconds
+    for (i=0; i<HS_STATS_HISTOGRAM_BUCKETS; i++)
+        fprintf(json, "%s%llu", i ? ", " : "", (unsigned long long) stats.callback_time[i]);
+
+    fprintf(json, "] }");
+}
+
+// Latency
+
+typedef struct
+{
+    hs_client_t client;
+    uint64_t *samples;
+    int count;
+    int errors;
+} bench_latency_t;
+
+static void *bench_latency_thread(void *arg)
+{
+    bench_latency_t *b = arg;
+    char response[16];
+    uint64_t start;
+    int i;
+
+    for (i=0; i<b->count; i++)
+    {
+        start = bench_now();
+        if (hs_send_receive_sync(b->client, "*IDN?", 5, response, sizeof(response), BENCH_TIMEOUT) != 2)
+            b->errors++;
+        b->samples[i] = bench_now() - start;
+    }
+
+    return NULL;
+}
+
+static int bench_latency(int port, int workers, int connections, bool first)
+{
+    bench_latency_t b[BENCH_CONNECTIONS_MAX];
+    pthread_t thread[BENCH_CONNECTIONS_MAX];
+    uint64_t *samples, start, elapsed;
+    int i, n, errors = 0;
+
+    n = round_trips / connections;
+    samples = malloc(sizeof(uint64_t) * n * connections);
+    if (samples == NULL)
+        return -1;
+
+    for (i=0; i<connections; i++)
+    {
+        b[i].client = hs_connect(address, port, "bench", BENCH_TIMEOUT);
+        if (b[i].client < 0)
+        {
+            fprintf(stderr, "Could not connect to benchmark server\n");
+            while (i-- > 0)
+                hs_disconnect(b[i].client);
+            free(samples);
+            return -1;
+        }
+        b[i].samples = samples + i * n;
+        b[i].count = n;
+        b[i].errors = 0;
+    }
+
+    start = bench_now();
+    for (i=0; i<connections; i++)
+        pthread_create(&thread[i], NULL, bench_latency_thread, &b[i]);
+    for (i=0; i<connections; i++)
+    {
+        pthread_join(thread[i], NULL);
+        errors += b[i].errors;
+    }
+    elapsed = bench_now() - start;
+
+    for (i=0; i<connections; i++)
+        hs_disconnect(b[i].client);
+
+    n *= connections;
+    qsort(samples, n, sizeof(uint64_t), compare_u64);
+
+    fprintf(json, "%s\n    { \"workers\": %d, \"connections\": %d, \"round_trips\": %d, \"errors\": %d, "
+            "\"round_trips_per_s\": %.0f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f }",
+            first ? "" : ",", workers, connections, n, errors, n / (elapsed / 1e9),
+            samples[n / 2] / 1e3, samples[(int) (n * 0.99)] / 1e3, samples[(int) (n * 0.999)] / 1e3);
+
+    free(samples);
+
+    return 0;
+}
+
+// Throughput
+
+static void bench_throughput(int port, bool upload, bool first)
+{
+    hs_client_t client;
+    char request[32], response[32];
+    uint64_t start, elapsed;
+    long size;
+    int i, iterations, errors;
+
+    client = hs_connect(address, port, upload ? "stream" : "bench", BENCH_TIMEOUT);
+    if (client < 0)
+        return;
+
+    for (size=1024; size<=bulk_size_max; size*=4)
+    {
+        iterations = BENCH_BULK_BYTES / size;
+        if (iterations < 3)
+            iterations = 3;
+        if (iterations > 1000)
+            iterations = 1000;
+
+        errors = 0;
+        snprintf(request, sizeof(request), "SEND %ld", size);
+
+        start = bench_now();
+        for (i=0; i<iterations; i++)
+        {
+            if (upload)
+            {
+                if (hs_send_receive_sync(client, bulk_buffer, size, response, sizeof(response), BENCH_TIMEOUT) < 0)
+                    errors++;
+            }
+            else if (hs_send_receive_sync(client, request, strlen(request), receive_buffer, size, BENCH_TIMEOUT) != size)
+                errors++;
+        }
+        elapsed = bench_now() - start;
+
+        fprintf(json, "%s\n    { \"direction\": \"%s\", \"size\": %ld, \"iterations\": %d, \"errors\": %d, "
+                "\"mb_per_s\": %.1f }", (first && (size == 1024)) ? "" : ",",
+                upload ? "upload" : "download", size, iterations, errors,
+                (double) size * iterations / (elapsed / 1e9) / 1e6);
+    }
+
+    hs_disconnect(client);
+}
+
+// Device clear
+
+static void bench_clear_handler(hs_client_t client, void *response, int length, void *data)
+{
+    // Download is abandoned by device clear, whatever it got
+}
+
+static void bench_clear(int port)
+{
+    char request[32], response[16];
+    uint64_t start, elapsed = 0;
+    hs_client_t client;
+    int i, n = 20, errors = 0;
+
+    client = hs_connect(address, port, "bench", BENCH_TIMEOUT);
+    if (client < 0)
+        return;
+
+    // Clear while bulk download is partly received, then check session
+    // still answers in step
+    snprintf(request, sizeof(request), "SEND %ld", bulk_size_max);
+    for (i=0; i<n; i++)
+    {
+        if (hs_send_receive_async(client, request, strlen(request), BENCH_TIMEOUT, bench_clear_handler, NULL) != 0)
+        {
+            errors++;
+            continue;
+        }
+        usleep(500 * (i % 5));
+
+        start = bench_now();
+        if (hs_device_clear(client, BENCH_TIMEOUT) != 0)
+            errors++;
+        elapsed += bench_now() - start;
+
+        if (hs_send_receive_sync(client, "*IDN?", 5, response, sizeof(response), BENCH_TIMEOUT) != 2)
+            errors++;
+    }
+
+    hs_disconnect(client);
+
+    fprintf(json, "  \"clear\": { \"clears\": %d, \"avg_us\": %.1f, \"errors\": %d },\n",
+            n, elapsed / 1e3 / n, errors);
+}
+
+// Connection setup
+
+static void bench_connect(int port)
+{
+    hs_connect_target_t targets[64];
+    uint64_t start, sequential, parallel;
+    int i, j, n = 200, errors = 0;
+    hs_client_t client;
+
+    start = bench_now();
+    for (i=0; i<n; i++)
+    {
+        client = hs_connect(address, port, "bench", BENCH_TIMEOUT);
+        if (client < 0)
+            errors++;
+        else
+            hs_disconnect(client);
+    }
+    sequential = bench_now() - start;
+
+    for (i=0; i<64; i++)
+    {
+        targets[i].address = address;
+        targets[i].port = port;
+        targets[i].subaddress = "bench";
+    }
+
+    start = bench_now();
+    for (j=0; j<5; j++)
+    {
+        hs_connect_many(targets, 64, BENCH_TIMEOUT);
+        for (i=0; i<64; i++)
+        {
+            if (targets[i].client < 0)
+                errors++;
+            else
+                hs_disconnect(targets[i].client);
+        }
+    }
+    parallel = bench_now() - start;
+
+    fprintf(json, "  \"connect\": { \"sequential_per_s\": %.0f, \"parallel_per_s\": %.0f, \"errors\": %d },\n",
+            n / (sequential / 1e9), 5 * 64 / (parallel / 1e9), errors);
+}
+
+int main(int argc, char *argv[])
+{
+    bool verbose = false;
+    char *trace_file = NULL;
+    unsigned w, c;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:n:m:T:v")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                loopback = (strcmp(optarg, "tcp") != 0);
+                address = loopback ? HS_LOOPBACK_ADDRESS : "127.0.0.1";
+                break;
+            case 'n':
+                round_trips = atoi(optarg);
+                break;
+            case 'm':
+                bulk_size_max = atol(optarg);
+                break;
+            case 'T':
+                trace_file = optarg;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-t loopback|tcp] [-n round trips] [-m max bulk size] [-T trace file] [-v]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    // Keep JSON apart from library messages
+    json = fdopen(dup(STDOUT_FILENO), "w");
+    if ((json == NULL) || (!verbose && (freopen("/dev/null", "w", stdout) == NULL)))
+        return 1;
+
+    bulk_buffer = calloc(1, bulk_size_max);
+    receive_buffer = calloc(1, bulk_size_max);
+    if ((bulk_buffer == NULL) || (receive_buffer == NULL))
+        return 1;
+
+    for (w=0; w<sizeof(workers_sweep) / sizeof(int); w++)
+    {
+        servers[w] = bench_server_start(BENCH_PORT_BASE + w, workers_sweep[w]);
+        if (servers[w] == NULL)
+            return 1;
+    }
+
+    // Trace rings keep the first records of each thread
+    if ((trace_file != NULL) && (hs_trace_enable(true) != 0))
+        return 1;
+
+    fprintf(json, "{\n  \"transport\": \"%s\",\n  \"latency\": [", loopback ? "loopback" : "tcp");
+    for (w=0; w<sizeof(workers_sweep) / sizeof(int); w++)
+        for (c=0; c<sizeof(connections_sweep) / sizeof(int); c++)
+            if (bench_latency(BENCH_PORT_BASE + w, workers_sweep[w], connections_sweep[c], (w == 0) && (c == 0)) != 0)
+                return 1;
+    fprintf(json, "\n  ],\n");
+
+    fprintf(json, "  \"throughput\": [");
+    bench_throughput(BENCH_PORT_BASE, true, true);
+    bench_throughput(BENCH_PORT_BASE, false, false);
+    fprintf(json, "\n  ],\n");
+
+    bench_clear(BENCH_PORT_BASE);
+    bench_connect(BENCH_PORT_BASE);
+
+    fprintf(json, "  \"server\": [");
+    bench_stats(servers[0], "bench", true);
+    bench_stats(servers[0], "stream", false);
+    fprintf(json, "\n  ]");
+
+    if (trace_file != NULL)
+    {
+        hs_trace_enable(false);
+        fprintf(json, ",\n  \"trace\": { \"records\": %d, \"dropped\": %llu }",
+                hs_trace_dump(trace_file), (unsigned long long) hs_trace_dropped());
+    }
+
+    fprintf(json, "\n}\n");
+    fclose(json);
+
+    return 0;
+}
@@ -1,26 +1,107 @@
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include <hislip/common.h>
 #include <hislip/client.h>
 
-static void receive_handler(void *buffer, int length)
+static int responses = 0;
+
+static void receive_handler(hs_client_t client, void *buffer, int length, void *data)
+{
+    printf("Received (async %ld): %.*s\n", (long) data, length, (char *) buffer);
+    __atomic_add_fetch(&responses, 1, __ATOMIC_RELAXED);
+}
+
+static void srq_handler(hs_client_t client, uint8_t status, void *data)
 {
-    printf("Received: %s\n", (char *)buffer);
+    printf("Service request: 0x%02x\n", status);
 }
 
 int main(void)
 {
     char buffer[1000];
-    hs_client_t hislip0;
+    char response[2][100];
+    hs_group_member_t group[2];
+    hs_client_t hislip0, hislip1;
+    uint8_t status;
+    bool exclusive;
+    int i, length, holders;
 
     // Connect to HiSlip server
     hislip0 = hs_connect("127.0.0.1", HISLIP_PORT, "hislip0", 1000);
+    if (hislip0 < 0)
+        return 1;
+
+    // Send SCPI query on sync channel and wait for response
+    strcpy(buffer, "*IDN?");
+    length = hs_send_receive_sync(hislip0, buffer, strlen(buffer), buffer, sizeof(buffer) - 1, 1000);
+    if (length >= 0)
+    {
+        buffer[length] = 0;
+        printf("Received: %s\n", buffer);
+    }
+
+    // Read status byte on async channel
+    if (hs_status_query(hislip0, &status, 1000) == 0)
+        printf("Status: 0x%02x\n", status);
+
+    // Lock instrument exclusively for a while
+    if (hs_lock(hislip0, NULL, 1000, 1000) == 0)
+    {
+        if (hs_lock_info(hislip0, &exclusive, &holders, 1000) == 0)
+            printf("Locked (exclusive %d, %d holder(s))\n", exclusive, holders);
+        hs_unlock(hislip0, 1000);
+    }
+
+    // Get service requests by callback, operation complete raises one
+    hs_set_srq_callback(hislip0, srq_handler, NULL);
+    strcpy(buffer, "*OPC");
+    hs_send(hislip0, buffer, strlen(buffer), NULL, 1000);
+
+    // Pipeline SCPI queries on sync channel, then collect responses in order
+    strcpy(buffer, "*IDN?");
+    for (i=0; i<10; i++)
+        hs_send(hislip0, buffer, strlen(buffer), NULL, 1000);
+
+    for (i=0; i<10; i++)
+    {
+        length = hs_receive(hislip0, buffer, sizeof(buffer) - 1, NULL, 1000);
+        if (length < 0)
+            break;
+        buffer[length] = 0;
+        printf("Received: %s\n", buffer);
+    }
+
+    // Queue SCPI queries, responses are delivered to handler by event loop
+    strcpy(buffer, "*IDN?");
+    for (i=0; i<10; i++)
+        hs_send_receive_async(hislip0, buffer, strlen(buffer), 1000, receive_handler, (void *) (long) i);
+
+    for (i=0; (i<100) && (__atomic_load_n(&responses, __ATOMIC_RELAXED) < 10); i++)
+        usleep(10000);
+
+    // Abandon anything still in progress and start over
+    if (hs_device_clear(hislip0, 1000) == 0)
+        printf("Device cleared\n");
+
+    // Query a group of sessions in parallel
+    hislip1 = hs_connect("127.0.0.1", HISLIP_PORT, "hislip0", 1000);
+    if (hislip1 >= 0)
+    {
+        memset(group, 0, sizeof(group));
+        group[0].client = hislip0;
+        group[0].response = response[0];
+        group[0].capacity = sizeof(response[0]);
+        group[1].client = hislip1;
+        group[1].response = response[1];
+        group[1].capacity = sizeof(response[1]);
 
-    // Send SCPI command on sync channel
-    //strcpy(buffer, "*IDN?");
-    //hs_send_receive_sync(hislip0, buffer, strlen(buffer), 1000);
+        hs_group_send_receive(group, 2, "*IDN?", 5, 1000);
+        for (i=0; i<2; i++)
+            printf("Received (group %d): %.*s\n", i, group[i].status, response[i]);
 
-    // Send SCPI command on async channel
-    //hs_send_receive_async(hislip0, buffer, strlen(buffer), 1000, receive_handler);
+        hs_disconnect(hislip1);
+    }
 
     // Disconnect
     hs_disconnect(hislip0);
@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "message.h"
+#include "pool.h"
+
+// Microbenchmark of the message codec and connection buffer pool.
+//
+// Measures ns/op and allocations/op for header encode, header decode plus
+// verify and complete message framing (msg_create()/msg_destroy() and
+// parsing of back-to-back messages) across payload sizes, and for leasing
+// buffers from a warm pool at several in-flight depths. Results are written
+// as JSON to stdout. Fails if a warm pool allocates.
+//
+// Usage: microbench [-n iterations]
+
+static long iterations = 1000000;
+static unsigned long allocations;
+static volatile uint64_t sink;
+
+// Count allocations made by the library, glibc allocator does the work
+extern void *__libc_malloc(size_t size);
+
+void *malloc(size_t size)
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_report(const char *name, long size, long n, uint64_t start, unsigned long allocations_start, bool first)
+{
+    uint64_t elapsed = bench_now() - start;
+
+    printf("%s\n    { \"name\": \"%s\", \"size\": %ld, \"ops\": %ld, \"ns_per_op\": %.2f, \"allocs_per_op\": %.2f }",
+           first ? "" : ",", name, size, n, (double) elapsed / n, (double) (allocations - allocations_start) / n);
+}
+
+static void bench_header_encode(void)
+{
+    uint8_t buffer[MSG_HEADER_SIZE];
+    unsigned long a = allocations;
+    uint64_t start = bench_now();
+    long i;
+
+    for (i=0; i<iterations; i++)
+    {
+        msg_header_encode(buffer, DataEnd, 0, MSG_ID_INITIAL + 2 * i, i);
+        sink += buffer[15];
+    }
+
+    bench_report("header_encode", 0, iterations, start, a, true);
+}
+
+static void bench_header_decode(void)
+{
+    uint8_t buffer[MSG_HEADER_SIZE];
+    msg_header_t header;
+    unsigned long a;
+    uint64_t start;
+    long i;
+
+    msg_header_encode(buffer, DataEnd, 0, MSG_ID_INITIAL, 1024);
+
+    a = allocations;
+    start = bench_now();
+    for (i=0; i<iterations; i++)
+    {
+        msg_header_decode(&header, buffer);
+        if (msg_header_verify(&header) != 0)
+            break;
+        sink += header.payload_length;
+    }
+
+    bench_report("header_decode_verify", 0, i, start, a, false);
+}
+
+static void bench_frame(long size, void *payload)
+{
+    void *message;
+    unsigned long a;
+    uint64_t start;
+    long i, n;
+
+    // Keep bytes copied per size roughly constant
+    n = iterations / (1 + size / 1024);
+    if (n < 100)
+        n = 100;
+
+    a = allocations;
+    start = bench_now();
+    for (i=0; i<n; i++)
+    {
+        if (msg_create(&message, Data, 0, MSG_ID_INITIAL, size, payload) != 0)
+            break;
+        sink += ((uint8_t *) message)[MSG_HEADER_SIZE - 1];
+        msg_destroy(message);
+    }
+
+    bench_report("frame_create", size, i, start, a, false);
+}
+
+static void bench_parse(long size)
+{
+    uint8_t *buffer, *p, *end;
+    msg_header_t header;
+    long count, n, i = 0;
+    unsigned long a;
+    uint64_t start;
+
+    // Buffer of back-to-back messages as read from a socket
+    count = 0x1000000 / (MSG_HEADER_SIZE + size);
+    if (count < 16)
+        count = 16;
+    buffer = calloc(count, MSG_HEADER_SIZE + size);
+    if (buffer == NULL)
+        return;
+    for (p=buffer, n=0; n<count; n++, p+=MSG_HEADER_SIZE + size)
+        msg_header_encode(p, (n == count - 1) ? DataEnd : Data, 0, MSG_ID_INITIAL, size);
+    end = p;
+
+    n = iterations / count;
+    if (n < 4)
+        n = 4;
+
+    a = allocations;
+    start = bench_now();
+    while (i < n * count)
+    {
+        for (p=buffer; p<end; p+=MSG_HEADER_SIZE + header.payload_length, i++)
+        {
+            msg_header_decode(&header, p);
+            if (msg_header_verify(&header) != 0)
+                goto out;
+        }
+    }
+out:
+    bench_report("frame_parse", size, i, start, a, false);
+
+    free(buffer);
+}
+
+static int bench_pool(int depth)
+{
+    pool_buffer_t *buffer[64];
+    char name[32];
+    unsigned long a;
+    uint64_t start;
+    pool_t pool;
+    long i, n;
+    int j;
+
+    // Pool sized for depth, as server sizes connection pools by queue depth
+    pool_init(&pool, depth, 0x100000);
+
+    // Warm up, then every lease should come from cache
+    n = iterations / depth;
+    a = 0;
+    start = 0;
+    for (i=-1; i<n; i++)
+    {
+        if (i == 0)
+        {
+            a = allocations;
+            start = bench_now();
+        }
+        for (j=0; j<depth; j++)
+            buffer[j] = pool_get(&pool, 1024);
+        for (j=0; j<depth; j++)
+            pool_put(buffer[j]);
+    }
+
+    snprintf(name, sizeof(name), "pool_lease_depth_%d", depth);
+    bench_report(name, 1024, n * depth, start, a, false);
+    a = allocations - a;
+
+    pool_destroy(&pool);
+
+    return (a == 0) ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    static long sizes[] = { 0, 16, 256, 4096, 65536, 1048576 };
+    static int depths[] = { 1, 4, 16, 64 };
+    void *payload;
+    unsigned s;
+    int opt, status = 0;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                iterations = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n iterations]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    payload = calloc(1, sizes[sizeof(sizes) / sizeof(long) - 1]);
+    if ((payload == NULL) || (iterations <= 0))
+        return 1;
+
+    printf("{\n  \"iterations\": %ld,\n  \"results\": [", iterations);
+
+    bench_header_encode();
+    bench_header_decode();
+    for (s=0; s<sizeof(sizes) / sizeof(long); s++)
+        bench_frame(sizes[s], payload);
+    for (s=0; s<sizeof(sizes) / sizeof(long); s++)
+        bench_parse(sizes[s]);
+    for (s=0; s<sizeof(depths) / sizeof(int); s++)
+    {
+        if (bench_pool(depths[s]) != 0)
+            status = 1;
+    }
+
+    printf("\n  ]\n}\n");
+
+    free(payload);
+
+    if (status != 0)
+        fprintf(stderr, "Warm pool allocated\n");
+
+    return status;
+}
@@ -1,16 +1,46 @@
 #include <stdio.h>
+#include <string.h>
 #include <hislip/server.h>
 #include <hislip/common.h>
 
-int hislip0_message_sync(void *buffer, int length)
+int hislip0_message_sync(hs_request_t *request, void *buffer, int length)
+{
+    char *idn = "libhislip,test-server,0,0.1";
+
+    printf("Received: %s\n", (char *)buffer);
+
+    // Respond to queries
+    if (strcmp(buffer, "*IDN?") == 0)
+        return hs_send_response(request, idn, strlen(idn));
+
+    // Operation complete requests service (ESB bit of status byte)
+    if (strcmp(buffer, "*OPC") == 0)
+        return hs_service_request(request, 0x20);
+
+    return 0;
+}
+
+int hislip0_message_async(hs_request_t *request, void *buffer, int length)
 {
     return 0;
-    // How to send response? Maybe add some message id?
-    // send_response(id, void *buffer, int length);
 }
 
-int hislip0_message_async(void *buffer, int length)
+int hislip1_message_stream(hs_request_t *request, void *buffer, int length, int flags)
 {
+    static unsigned long long total;
+    char response[32];
+
+    // Count streamed bytes and report total at end of message
+    if (flags & HS_STREAM_START)
+        total = 0;
+    total += length;
+
+    if (flags & HS_STREAM_END)
+    {
+        snprintf(response, sizeof(response), "%llu", total);
+        return hs_send_response(request, response, strlen(response));
+    }
+
     return 0;
 }
 
@@ -19,7 +49,8 @@ int main(void)
     int status;
     hs_server_t server;
     hs_server_config_t config;
-    hs_subaddress_callbacks_t hislip0_callbacks;
+    hs_subaddress_callbacks_t hislip0_callbacks = {};
+    hs_subaddress_callbacks_t hislip1_callbacks = {};
 
     // Initialize server configuration
     hs_server_config_init(&config);
@@ -30,6 +61,10 @@ int main(void)
     config.worker_queue_depth_max = 20;
     config.payload_size_max = 0x100000; // 1 MB
     config.message_timeout = 3000; // 3 seconds
+    config.io_mode = HS_IO_URING;
+    config.io_threads_max = 2;
+    config.overlap_mode = true;
+    config.shards = 2;
 
     // Initialize server
     hs_server_init(&server, &config);
@@ -38,9 +73,12 @@ int main(void)
     hislip0_callbacks.message_sync = hislip0_message_sync;
     hislip0_callbacks.message_async = hislip0_message_async;
     hs_server_register_subaddress(&server, "hislip0", &hislip0_callbacks);
-    hs_server_register_subaddress(&server, "hislip1", &hislip0_callbacks);
     hs_server_register_subaddress(&server, "hislip2", &hislip0_callbacks);
 
+    // Register streaming message handler
+    hislip1_callbacks.message_stream = hislip1_message_stream;
+    hs_server_register_subaddress(&server, "hislip1", &hislip1_callbacks);
+
     // Start server
     status = hs_server_run(&server);
 